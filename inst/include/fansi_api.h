@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+/*
+ * C API for use by other packages
+ *
+ * Add `LinkingTo: fansi` and `Imports: fansi` to your DESCRIPTION, make sure
+ * the fansi namespace is loaded (e.g. `importFrom(fansi, strip_ctl)` in your
+ * NAMESPACE), and then:
+ *
+ *   #include <fansi_api.h>
+ *
+ *   SEXP res = PROTECT(fansi_nchar(x, FANSI_TYPE_WIDTH, FANSI_CTL_ALL, 0));
+ *
+ * These functions skip the R level argument checking and conversion of the
+ * corresponding R functions so they are much cheaper to call on small inputs,
+ * except for `fansi_substr` which evaluates `substr2_ctl` so its results are
+ * always the same.  In exchange:
+ *
+ * * `x` must be a character vector of UTF-8 or ASCII strings (see
+ *   `enc2utf8`); NA elements are allowed.
+ * * Other vector arguments must be integer vectors of the documented lengths,
+ *   no coercion or recycling beyond that is done.
+ * * `term_cap` and `ctl` are bit masks made from the FANSI_TERM_* and
+ *   FANSI_CTL_* constants below rather than character vectors.
+ *
+ * All return values are newly allocated and unprotected.  Errors and warnings
+ * are signaled as with the R functions.
+ *
+ * Functions are never changed once released.  New ones increment
+ * FANSI_API_VERSION, so if you need one added after version 1 check
+ * `fansi_api_version() >= n` first.
+ */
+
+#ifndef FANSI_API_H
+#define FANSI_API_H
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#define FANSI_API_VERSION 1
+
+// `type` values
+
+#define FANSI_TYPE_CHARS 0
+#define FANSI_TYPE_WIDTH 1
+#define FANSI_TYPE_BYTES 2
+
+// `round` values, as for `substr2_ctl`
+
+#define FANSI_ROUND_START 0
+#define FANSI_ROUND_STOP 1
+#define FANSI_ROUND_BOTH 2
+#define FANSI_ROUND_NEITHER 3
+
+// `term_cap` bits, as for `getOption('fansi.term.cap')`
+
+#define FANSI_TERM_BRIGHT 1
+#define FANSI_TERM_256 2
+#define FANSI_TERM_TRUECOLOR 4
+
+// `ctl` bits, as for the `ctl` parameter of e.g. `strip_ctl`
+
+#define FANSI_CTL_NL 1
+#define FANSI_CTL_C0 2
+#define FANSI_CTL_SGR 4
+#define FANSI_CTL_CSI 8
+#define FANSI_CTL_ESC 16
+#define FANSI_CTL_ALL 31
+
+/*
+ * Version of the API provided by the installed fansi.
+ */
+static inline int fansi_api_version(void) {
+  static int (*fun)(void) = NULL;
+  if(!fun) fun = (int (*)(void)) R_GetCCallable("fansi", "fansi_api_version");
+  return fun();
+}
+/*
+ * As `nchar_ctl(x, type, allowNA=FALSE, keepNA=NA, warn, ctl)`, with `type`
+ * one of FANSI_TYPE_*.  Returns an integer vector.
+ */
+static inline SEXP fansi_nchar(SEXP x, int type, int ctl, int warn) {
+  static SEXP (*fun)(SEXP, int, int, int) = NULL;
+  if(!fun)
+    fun = (SEXP (*)(SEXP, int, int, int))
+      R_GetCCallable("fansi", "fansi_nchar");
+  return fun(x, type, ctl, warn);
+}
+/*
+ * As `strip_ctl(x, ctl, warn)`.
+ */
+static inline SEXP fansi_strip(SEXP x, int ctl, int warn) {
+  static SEXP (*fun)(SEXP, int, int) = NULL;
+  if(!fun)
+    fun = (SEXP (*)(SEXP, int, int)) R_GetCCallable("fansi", "fansi_strip");
+  return fun(x, ctl, warn);
+}
+/*
+ * As `substr2_ctl(x, start, stop, type, round, tabs.as.spaces=FALSE,
+ * warn=warn, term.cap=term_cap, ctl=ctl)`, with `type` FANSI_TYPE_CHARS or
+ * FANSI_TYPE_WIDTH, and `round` one of FANSI_ROUND_*.  `carry`, `terminate`,
+ * and `normalize` have their defaults.  `start` and `stop` must be integer
+ * vectors of length one or the same length as `x`.
+ */
+static inline SEXP fansi_substr(
+  SEXP x, SEXP start, SEXP stop, int type, int round, int term_cap, int ctl,
+  int warn
+) {
+  static SEXP (*fun)(SEXP, SEXP, SEXP, int, int, int, int, int) = NULL;
+  if(!fun)
+    fun = (SEXP (*)(SEXP, SEXP, SEXP, int, int, int, int, int))
+      R_GetCCallable("fansi", "fansi_substr");
+  return fun(x, start, stop, type, round, term_cap, ctl, warn);
+}
+/*
+ * The SGR sequence that reproduces the active style at the end of each
+ * element of `x`, or "" if there is none.  If `carry` is non-zero, styles
+ * carry from one element to the next as with the `carry` parameter of e.g.
+ * `substr_ctl`.
+ */
+static inline SEXP fansi_state_at_end(
+  SEXP x, int term_cap, int carry, int warn
+) {
+  static SEXP (*fun)(SEXP, int, int, int) = NULL;
+  if(!fun)
+    fun = (SEXP (*)(SEXP, int, int, int))
+      R_GetCCallable("fansi", "fansi_state_at_end");
+  return fun(x, term_cap, carry, warn);
+}
+
+#endif
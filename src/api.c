@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+#include <R_ext/Rdynload.h>
+
+/*
+ * C API for other packages
+ *
+ * These are registered with `R_RegisterCCallable` in `R_init_fansi`, and
+ * declared for downstream use in inst/include/fansi_api.h.  Other than
+ * `FANSI_api_substr` they skip all the R level argument processing (partial
+ * matching, recycling, re-encoding) so callers are responsible for providing
+ * valid inputs, in particular `x` must be UTF-8 or ASCII.  `term_cap` and
+ * `ctl` are the bit masks described in the header, which match the internal
+ * `FANSI_state` encoding.
+ *
+ * Once released a function's signature and behavior never change; additions
+ * bump FANSI_API_VERSION.
+ */
+
+#define FANSI_API_VERSION 1
+
+/*
+ * The .Call entry points take the R side 1 based indices into VALID.TERM.CAP
+ * and VALID.CTL, so convert the masks back to that.  `offset` is 1 for
+ * `term_cap`, and 2 for `ctl` since the first VALID.CTL value is "all".
+ */
+static SEXP mask_as_idx(int mask, int bits, int offset) {
+  int n = 0;
+  for(int i = 0; i < bits; ++i) n += (mask & (1 << i)) > 0;
+  SEXP res = PROTECT(allocVector(INTSXP, n));
+  n = 0;
+  for(int i = 0; i < bits; ++i)
+    if(mask & (1 << i)) INTEGER(res)[n++] = i + offset;
+  UNPROTECT(1);
+  return res;
+}
+static void check_x(SEXP x) {
+  if(TYPEOF(x) != STRSXP)
+    error("Argument `x` should be a character vector.");
+  R_xlen_t x_len = XLENGTH(x);
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    SEXP chr = STRING_ELT(x, i);
+    if(chr != NA_STRING && getCharCE(chr) == CE_LATIN1)
+      error(
+        "String at index %jd is not UTF-8, %s.", FANSI_ind(i),
+        "use `enc2utf8` or `translateCharUTF8` first"
+      );
+  }
+}
+int FANSI_api_version(void) {
+  return FANSI_API_VERSION;
+}
+/*
+ * Equivalent to `nchar_ctl(x, type, allowNA=FALSE, keepNA=NA, warn, ctl)`,
+ * with `type` 0 for "chars", 1 for "width", 2 for "bytes".
+ */
+SEXP FANSI_api_nchar(SEXP x, int type, int ctl, int warn) {
+  check_x(x);
+  if(type < 0 || type > 2) error("Argument `type` must be 0, 1, or 2.");
+  SEXP ctl_idx = PROTECT(mask_as_idx(ctl, 5, 2));
+  SEXP term_cap_idx = PROTECT(mask_as_idx(0, 3, 1));
+  SEXP type_sxp = PROTECT(ScalarInteger(type));
+  SEXP allowNA = PROTECT(ScalarLogical(0));
+  SEXP keepNA = PROTECT(ScalarLogical(NA_LOGICAL));
+  SEXP warn_sxp = PROTECT(ScalarLogical(warn));
+  SEXP res = PROTECT(
+    FANSI_nchar(
+      x, type_sxp, allowNA, keepNA, warn_sxp, term_cap_idx, ctl_idx
+    )
+  );
+  UNPROTECT(7);
+  return res;
+}
+/*
+ * Equivalent to `strip_ctl(x, ctl, warn)`.
+ */
+SEXP FANSI_api_strip(SEXP x, int ctl, int warn) {
+  check_x(x);
+  SEXP ctl_idx = PROTECT(mask_as_idx(ctl, 5, 2));
+  SEXP warn_sxp = PROTECT(ScalarLogical(warn));
+  SEXP res = PROTECT(FANSI_strip(x, ctl_idx, warn_sxp));
+  UNPROTECT(3);
+  return res;
+}
+/*
+ * Equivalent to the internal `state_at_end(x, warn, term.cap, carry)`: the
+ * SGR needed to reproduce the state at the end of each element.
+ */
+SEXP FANSI_api_state_at_end(SEXP x, int term_cap, int carry, int warn) {
+  check_x(x);
+  SEXP term_cap_idx = PROTECT(mask_as_idx(term_cap, 3, 1));
+  SEXP warn_sxp = PROTECT(ScalarLogical(warn));
+  SEXP carry_sxp = PROTECT(ScalarLogical(carry));
+  SEXP res = PROTECT(
+    FANSI_state_at_end(x, warn_sxp, term_cap_idx, carry_sxp)
+  );
+  UNPROTECT(4);
+  return res;
+}
+/*
+ * The `term_cap` and `ctl` masks as the character vectors `substr2_ctl`
+ * accepts, with the names in bit order.
+ */
+static const char * term_cap_names[] = {"bright", "256", "truecolor"};
+static const char * ctl_names[] = {"nl", "c0", "sgr", "csi", "esc"};
+
+static SEXP mask_as_chr(int mask, const char ** names, int bits) {
+  int n = 0;
+  for(int i = 0; i < bits; ++i) n += (mask & (1 << i)) > 0;
+  SEXP res = PROTECT(allocVector(STRSXP, n));
+  n = 0;
+  for(int i = 0; i < bits; ++i)
+    if(mask & (1 << i)) SET_STRING_ELT(res, n++, mkChar(names[i]));
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Equivalent to `substr2_ctl(x, start, stop, type, round,
+ * tabs.as.spaces=FALSE, warn=warn, term.cap, ctl)` with `type` 0 for "chars"
+ * or 1 for "width", and `round` 0 for "start", 1 "stop", 2 "both", 3
+ * "neither".
+ *
+ * This evaluates `substr2_ctl` itself rather than re-implementing it so that
+ * the handling of the SGR opened and closed around each substring, and of
+ * the other escape sequences, is always the same.
+ *
+ * @param start, stop integer vectors either length 1 or the same length as
+ *   `x`.
+ */
+SEXP FANSI_api_substr(
+  SEXP x, SEXP start, SEXP stop, int type, int round, int term_cap, int ctl,
+  int warn
+) {
+  check_x(x);
+  R_xlen_t x_len = XLENGTH(x);
+  if(
+    TYPEOF(start) != INTSXP || TYPEOF(stop) != INTSXP ||
+    (XLENGTH(start) != 1 && XLENGTH(start) != x_len) ||
+    (XLENGTH(stop) != 1 && XLENGTH(stop) != x_len)
+  )
+    error(
+      "%s%s", "Arguments `start` and `stop` must be integer vectors length 1 ",
+      "or the same length as `x`."
+    );
+  if(type < 0 || type > 1) error("Argument `type` must be 0 or 1.");
+  if(round < 0 || round > 3) error("Argument `round` must be in 0:3.");
+
+  const char * types[] = {"chars", "width"};
+  const char * rounds[] = {"start", "stop", "both", "neither"};
+  const char * tags[] = {
+    NULL, NULL, NULL, "type", "round", "tabs.as.spaces", "warn", "term.cap",
+    "ctl"
+  };
+  SEXP args[] = {
+    x, start, stop,
+    PROTECT(mkString(types[type])),
+    PROTECT(mkString(rounds[round])),
+    PROTECT(ScalarLogical(0)),
+    PROTECT(ScalarLogical(warn)),
+    PROTECT(mask_as_chr(term_cap, term_cap_names, 3)),
+    PROTECT(mask_as_chr(ctl, ctl_names, 5))
+  };
+  int args_n = (int) (sizeof(args) / sizeof(SEXP));
+  SEXP call = PROTECT(allocVector(LANGSXP, args_n + 1));
+  SEXP node = call;
+  SETCAR(node, install("substr2_ctl"));
+  for(int i = 0; i < args_n; ++i) {
+    node = CDR(node);
+    SETCAR(node, args[i]);
+    if(tags[i]) SET_TAG(node, install(tags[i]));
+  }
+  SEXP ns = PROTECT(R_FindNamespace(PROTECT(mkString("fansi"))));
+  SEXP res = PROTECT(eval(call, ns));
+  UNPROTECT(10);
+  return res;
+}
+SEXP FANSI_api_substr_ext(
+  SEXP x, SEXP start, SEXP stop, SEXP type, SEXP round, SEXP term_cap,
+  SEXP ctl, SEXP warn
+) {
+  return FANSI_api_substr(
+    x, start, stop, asInteger(type), asInteger(round), asInteger(term_cap),
+    asInteger(ctl), asLogical(warn)
+  );
+}
+/*
+ * Register the API, called from `R_init_fansi`
+ */
+void FANSI_api_register(void) {
+  R_RegisterCCallable(
+    "fansi", "fansi_api_version", (DL_FUNC) &FANSI_api_version
+  );
+  R_RegisterCCallable("fansi", "fansi_nchar", (DL_FUNC) &FANSI_api_nchar);
+  R_RegisterCCallable("fansi", "fansi_strip", (DL_FUNC) &FANSI_api_strip);
+  R_RegisterCCallable(
+    "fansi", "fansi_state_at_end", (DL_FUNC) &FANSI_api_state_at_end
+  );
+  R_RegisterCCallable("fansi", "fansi_substr", (DL_FUNC) &FANSI_api_substr);
+}
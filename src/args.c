@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Argument validation for the most frequently called exported functions
+ *
+ * `nchar_ctl`, `substr2_ctl`, and `strwrap2_ctl` are often called many times
+ * on short strings, in which case the R level checks (`pmatch`, `enc2utf8`,
+ * `rep`, etc.) dominate.  Each has a single entry point here that does all
+ * the checks in the same order and with the same messages as the R code they
+ * replace.  If `opts` is not NULL it must be a `fansi_opts` object, and its
+ * already resolved settings are used instead of the `warn`, `term.cap`,
+ * `ctl`, `tabs.as.spaces`, and `tab.stops` arguments (see opts.c).
+ */
+
+/*
+ * `if(!is.logical(x)) x <- as.logical(x)` followed by a length and NA check
+ *
+ * Also used by opts.c, as is `FANSI_arg_tab_stops`.
+ */
+int FANSI_arg_flag(SEXP x, const char * name, const char * err) {
+  int res = NA_LOGICAL;
+  if(xlength(x) == 1) res = asLogical(x);
+  if(res == NA_LOGICAL) error("Argument `%s` must be %s.", name, err);
+  return res;
+}
+static int is_num(SEXP x) {
+  return (TYPEOF(x) == INTSXP && !inherits(x, "factor")) ||
+    TYPEOF(x) == REALSXP;
+}
+/*
+ * Scalar numeric that is not NA, returned as a double
+ */
+static double arg_num(SEXP x, int positive, const char * name) {
+  double res = NA_REAL;
+  if(is_num(x) && XLENGTH(x) == 1) res = asReal(x);
+  if(ISNAN(res) || (positive && res < 0))
+    error(
+      "Argument `%s` must be a %sscalar numeric.", name,
+      positive ? "positive " : ""
+    );
+  return res;
+}
+/*
+ * As `pmatch(x, choices)` for a scalar `x`
+ *
+ * @return the 0 based index of the match or -1 if there is none.
+ */
+static int arg_pmatch(SEXP x, const char ** choices, int n) {
+  if(
+    TYPEOF(x) != STRSXP || XLENGTH(x) != 1 || STRING_ELT(x, 0) == NA_STRING
+  )
+    return -1;
+  const char * chr = CHAR(STRING_ELT(x, 0));
+  size_t len = strlen(chr);
+  int match = -1;
+  if(!len) return match;
+
+  for(int i = 0; i < n; ++i) if(!strcmp(chr, choices[i])) return i;
+  for(int i = 0; i < n; ++i) {
+    if(!strncmp(chr, choices[i], len)) {
+      if(match >= 0) return -1;  // ambiguous
+      match = i;
+  } }
+  return match;
+}
+/*
+ * As `enc2utf8(x)`, optionally with an error for "bytes" strings
+ */
+static SEXP arg_utf8(SEXP x, int bytes_err) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: expected character vector."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  SEXP res = x;
+  PROTECT_INDEX ipx;
+  PROTECT_WITH_INDEX(res, &ipx);
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) continue;
+    cetype_t type = getCharCE(chr);
+    if(type == CE_UTF8) continue;
+    if(type == CE_BYTES) {
+      if(bytes_err) error("BYTE encoded strings are not supported.");
+      continue;
+    }
+    const char * c = CHAR(chr);
+    while(*c && (unsigned char) *c < 0x80) ++c;
+    if(!*c) continue;   // ASCII
+
+    if(res == x) REPROTECT(res = duplicate(x), ipx);
+    SET_STRING_ELT(res, i, mkCharCE(translateCharUTF8(chr), CE_UTF8));
+  }
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * As `rep(as.integer(x), length.out=len)`, also setting values less than one
+ * to one if `min_one` is set
+ */
+static SEXP arg_recycle_int(SEXP x, R_xlen_t len, int min_one) {
+  SEXP x_int = PROTECT(
+    x == R_NilValue ? allocVector(INTSXP, 0) : coerceVector(x, INTSXP)
+  );
+  R_xlen_t x_len = XLENGTH(x_int);
+  SEXP res = PROTECT(allocVector(INTSXP, len));
+  for(R_xlen_t i = 0; i < len; ++i) {
+    int val = x_len ? INTEGER(x_int)[i % x_len] : NA_INTEGER;
+    if(min_one && val != NA_INTEGER && val < 1) val = 1;
+    INTEGER(res)[i] = val;
+  }
+  UNPROTECT(2);
+  return res;
+}
+SEXP FANSI_arg_tab_stops(SEXP x) {
+  int valid = is_num(x) && XLENGTH(x);
+  R_xlen_t x_len = valid ? XLENGTH(x) : 0;
+  for(R_xlen_t i = 0; i < x_len && valid; ++i) {
+    if(TYPEOF(x) == INTSXP)
+      valid = INTEGER(x)[i] != NA_INTEGER && INTEGER(x)[i] >= 1;
+    else valid = !ISNAN(REAL(x)[i]) && REAL(x)[i] >= 1;
+  }
+  if(!valid)
+    error("Argument `tab.stops` must be numeric and strictly positive");
+  return coerceVector(x, INTSXP);
+}
+static const char * round_valid[] = {"start", "stop", "both", "neither"};
+static const char * substr_type_valid[] = {"chars", "width"};
+static const char * nchar_type_valid[] = {"chars", "width", "bytes"};
+
+/*
+ * Validate and resolve the `substr2_ctl` arguments
+ *
+ * @return a list with, in order, `x` in UTF-8, `start` and `stop` recycled to
+ *   the length of `x`, the 0 based `type`, the 1 based `round`,
+ *   `tabs.as.spaces`, integer `tab.stops`, `warn`, `term.cap` and `ctl` as
+ *   index vectors, `carry`, `terminate`, and `normalize`.
+ */
+SEXP FANSI_substr_args(
+  SEXP x, SEXP start, SEXP stop, SEXP type, SEXP round,
+  SEXP tabs_as_spaces, SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl,
+  SEXP carry, SEXP terminate, SEXP normalize, SEXP opts
+) {
+  SEXP res = PROTECT(allocVector(VECSXP, 13));
+  SEXP x_utf8 = arg_utf8(x, 1);
+  SET_VECTOR_ELT(res, 0, x_utf8);
+
+  if(opts == R_NilValue) {
+    const char * lgl = "TRUE or FALSE";
+    int tabs_int = FANSI_arg_flag(tabs_as_spaces, "tabs.as.spaces", lgl);
+    SET_VECTOR_ELT(res, 5, ScalarLogical(tabs_int));
+    SET_VECTOR_ELT(res, 6, FANSI_arg_tab_stops(tab_stops));
+    SET_VECTOR_ELT(res, 7, ScalarLogical(FANSI_arg_flag(warn, "warn", lgl)));
+    SET_VECTOR_ELT(res, 8, FANSI_term_cap_idx(term_cap));
+    SET_VECTOR_ELT(res, 9, FANSI_ctl_idx(ctl));
+  } else {
+    SEXP args = FANSI_opts_args(opts);
+    SET_VECTOR_ELT(res, 5, VECTOR_ELT(args, 5));
+    SET_VECTOR_ELT(res, 6, VECTOR_ELT(args, 6));
+    SET_VECTOR_ELT(res, 7, VECTOR_ELT(args, 0));
+    SET_VECTOR_ELT(res, 8, VECTOR_ELT(args, 2));
+    SET_VECTOR_ELT(res, 9, VECTOR_ELT(args, 4));
+  }
+  int carry_int = FANSI_arg_flag(carry, "carry", "TRUE or FALSE");
+  int term_int = FANSI_arg_flag(terminate, "terminate", "TRUE or FALSE");
+  int norm_int = FANSI_arg_flag(normalize, "normalize", "TRUE or FALSE");
+
+  int round_int = arg_pmatch(round, round_valid, 4);
+  if(round_int < 0)
+    error(
+      "Argument `round` must partial match one of %s",
+      "c(\"start\", \"stop\", \"both\", \"neither\")"
+    );
+  int type_int = arg_pmatch(type, substr_type_valid, 2);
+  if(type_int < 0)
+    error(
+      "Argument `type` must partial match one of %s", "c(\"chars\", \"width\")"
+    );
+  R_xlen_t x_len = XLENGTH(x_utf8);
+  SET_VECTOR_ELT(res, 1, arg_recycle_int(start, x_len, 1));
+  SET_VECTOR_ELT(res, 2, arg_recycle_int(stop, x_len, 0));
+  SET_VECTOR_ELT(res, 3, ScalarInteger(type_int));
+  SET_VECTOR_ELT(res, 4, ScalarInteger(round_int + 1));
+  SET_VECTOR_ELT(res, 10, ScalarLogical(carry_int));
+  SET_VECTOR_ELT(res, 11, ScalarLogical(term_int));
+  SET_VECTOR_ELT(res, 12, ScalarLogical(norm_int));
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Validate the `nchar_ctl` arguments and compute the result
+ */
+SEXP FANSI_nchar_ctl(
+  SEXP x, SEXP type, SEXP allowNA, SEXP keepNA, SEXP warn, SEXP ctl,
+  SEXP opts
+) {
+  int warn_int, ctl_int;
+  if(opts == R_NilValue) {
+    warn_int = FANSI_arg_flag(warn, "warn", "TRUE or FALSE");
+  } else {
+    struct FANSI_opts opts_int = FANSI_opts_get(opts);
+    warn_int = opts_int.warn;
+    ctl_int = opts_int.ctl;
+  }
+  int allowNA_int = FANSI_arg_flag(allowNA, "allowNA", "a scalar logical");
+  if(xlength(keepNA) != 1)
+    error("Argument `keepNA` must be a scalar logical.");
+  int keepNA_int = asLogical(keepNA);
+
+  if(opts == R_NilValue) ctl_int = FANSI_ctl_as_int(FANSI_ctl_idx(ctl));
+  if(
+    TYPEOF(type) != STRSXP || XLENGTH(type) != 1 ||
+    STRING_ELT(type, 0) == NA_STRING
+  )
+    error("Argument `type` must be scalar character and not NA.");
+  int type_int = arg_pmatch(type, nchar_type_valid, 3);
+  if(type_int < 0)
+    error(
+      "Argument `type` must partial match one of %s",
+      "'chars', 'width', or 'bytes'."
+    );
+  SEXP x_utf8 = PROTECT(arg_utf8(x, 0));
+  SEXP res = FANSI_nchar_int(
+    x_utf8, type_int, allowNA_int, keepNA_int, warn_int, ctl_int
+  );
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Validate the `strwrap2_ctl` arguments and compute the result
+ *
+ * @param strip_spaces NULL to use the default of `!tabs.as.spaces`.
+ * @param tabs_as_spaces with `opts`, NULL to use its `tabs.as.spaces` and
+ *   `tab.stops`; `strwrap_ctl` has neither so always passes FALSE.
+ */
+SEXP FANSI_strwrap_ctl(
+  SEXP x, SEXP width, SEXP indent, SEXP exdent, SEXP prefix, SEXP initial,
+  SEXP wrap_always, SEXP pad_end, SEXP strip_spaces, SEXP tabs_as_spaces,
+  SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry,
+  SEXP terminate, SEXP normalize, SEXP opts
+) {
+  const char * lgl = "TRUE or FALSE";
+  double width_num = arg_num(width, 0, "width");
+  arg_num(indent, 1, "indent");
+  arg_num(exdent, 1, "exdent");
+  if(TYPEOF(prefix) != STRSXP || XLENGTH(prefix) != 1)
+    error("Argument `prefix` must be a scalar character.");
+  if(TYPEOF(initial) != STRSXP || XLENGTH(initial) != 1)
+    error("Argument `initial` must be a scalar character.");
+
+  SEXP warn_sxp, term_cap_idx, tabs_sxp, tab_stops_int, ctl_idx;
+  if(opts == R_NilValue) {
+    warn_sxp = PROTECT(ScalarLogical(FANSI_arg_flag(warn, "warn", lgl)));
+    term_cap_idx = PROTECT(FANSI_term_cap_idx(term_cap));
+    tabs_sxp = PROTECT(
+      ScalarLogical(FANSI_arg_flag(tabs_as_spaces, "tabs.as.spaces", lgl))
+    );
+    tab_stops_int = PROTECT(FANSI_arg_tab_stops(tab_stops));
+    ctl_idx = PROTECT(FANSI_ctl_idx(ctl));
+  } else {
+    SEXP args = PROTECT(FANSI_opts_args(opts));
+    warn_sxp = VECTOR_ELT(args, 0);
+    term_cap_idx = VECTOR_ELT(args, 2);
+    ctl_idx = VECTOR_ELT(args, 4);
+    if(tabs_as_spaces == R_NilValue) {
+      tabs_sxp = PROTECT(VECTOR_ELT(args, 5));
+      tab_stops_int = PROTECT(VECTOR_ELT(args, 6));
+    } else {
+      tabs_sxp = PROTECT(
+        ScalarLogical(FANSI_arg_flag(tabs_as_spaces, "tabs.as.spaces", lgl))
+      );
+      tab_stops_int = PROTECT(FANSI_arg_tab_stops(tab_stops));
+    }
+    PROTECT(PROTECT(args));  // PROTECT stack balance
+  }
+  int tabs_int = asLogical(tabs_sxp);
+
+  int pad_ok = TYPEOF(pad_end) == STRSXP && XLENGTH(pad_end) == 1 &&
+    STRING_ELT(pad_end, 0) != NA_STRING;
+  if(pad_ok) {
+    const char * pad = translateCharUTF8(STRING_ELT(pad_end, 0));
+    int chars = 0;
+    for(; *pad; ++pad) chars += (*pad & 0xc0) != 0x80;
+    pad_ok = chars < 2;
+  }
+  if(!pad_ok)
+    error("Argument `pad.end` must be a one character or empty string.");
+
+  int wrap_int = FANSI_arg_flag(wrap_always, "wrap.always", lgl);
+  int strip_int = strip_spaces == R_NilValue ?
+    !tabs_int : FANSI_arg_flag(strip_spaces, "strip.spaces", lgl);
+  if(wrap_int && width_num < 2)
+    error("Width must be at least 2 in `wrap.always` mode.");
+  if(tabs_int && strip_int)
+    error("`tabs.as.spaces` and `strip.spaces` should not both be TRUE.");
+
+  int carry_int = FANSI_arg_flag(carry, "carry", lgl);
+  int term_int = FANSI_arg_flag(terminate, "terminate", lgl);
+  int norm_int = FANSI_arg_flag(normalize, "normalize", lgl);
+
+  // `max(c(as.integer(width) - 1L, 1L))`
+  int width_int = asInteger(width);
+  if(width_int != NA_INTEGER) width_int = width_int > 2 ? width_int - 1 : 1;
+
+  SEXP x_utf8 = PROTECT(arg_utf8(x, 0));
+  SEXP prefix_utf8 = PROTECT(arg_utf8(prefix, 0));
+  SEXP initial_utf8 = PROTECT(arg_utf8(initial, 0));
+  SEXP width_sxp = PROTECT(ScalarInteger(width_int));
+  SEXP indent_sxp = PROTECT(ScalarInteger(asInteger(indent)));
+  SEXP exdent_sxp = PROTECT(ScalarInteger(asInteger(exdent)));
+  SEXP wrap_sxp = PROTECT(ScalarLogical(wrap_int));
+  SEXP strip_sxp = PROTECT(ScalarLogical(strip_int));
+  SEXP first_only = PROTECT(ScalarLogical(0));
+  SEXP carry_sxp = PROTECT(ScalarLogical(carry_int));
+  SEXP term_sxp = PROTECT(ScalarLogical(term_int));
+  SEXP norm_sxp = PROTECT(ScalarLogical(norm_int));
+
+  SEXP res = FANSI_strwrap_ext(
+    x_utf8, width_sxp, indent_sxp, exdent_sxp, prefix_utf8, initial_utf8,
+    wrap_sxp, pad_end, strip_sxp, tabs_sxp, tab_stops_int, warn_sxp,
+    term_cap_idx, first_only, ctl_idx, carry_sxp, term_sxp, norm_sxp
+  );
+  UNPROTECT(17);
+  return res;
+}
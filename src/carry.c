@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Carry SGR state across character vector elements
+ *
+ * Operations that carry SGR state from one element into the next are
+ * inherently sequential, but applying SGR is associative: every attribute
+ * (each style bit, font, each color) is either left alone by an element, or
+ * overwritten with a value that doesn't depend on the prior state (resets are
+ * just overwrites with the default values).  So we can:
+ *
+ * 1. Compute the net effect ("delta") of each element independently.
+ * 2. Compose deltas chunk by chunk, scan over the chunk deltas, and then
+ *    propagate within chunks to get the state each element starts with.
+ * 3. Let the caller process each element independently from its known
+ *    starting state.
+ *
+ * Steps 1 and 2 are implemented here, and can use multiple threads.  Nothing
+ * here touches the R API aside from the allocations which happen on the main
+ * thread.
+ *
+ * Deltas are computed by reading an element starting from two different
+ * states: the blank state, and a "sentinel" state with every style bit on and
+ * impossible values for the font and colors.  Anything the element sets will
+ * have the same value in both read results.  Anything it doesn't set will be
+ * unchanged from the respective starting states, which we can detect as those
+ * differ in every attribute.
+ */
+
+#define FANSI_SENTINEL -2
+#define FANSI_STYLE_ALL ((1U << (FANSI_STYLE_MAX + 1)) - 1)
+
+struct FANSI_sgr FANSI_sgr_from_state(struct FANSI_state state) {
+  struct FANSI_sgr sgr = {
+    .style=state.style, .border=state.border, .ideogram=state.ideogram,
+    .font=state.font, .color=state.color, .bg_color=state.bg_color
+  };
+  for(int i = 0; i < 4; ++i) {
+    sgr.color_extra[i] = state.color_extra[i];
+    sgr.bg_color_extra[i] = state.bg_color_extra[i];
+  }
+  return sgr;
+}
+/*
+ * Replace the SGR attributes of a state, leaving everything else as is
+ */
+struct FANSI_state FANSI_sgr_to_state(
+  struct FANSI_sgr sgr, struct FANSI_state state
+) {
+  state.style = sgr.style;
+  state.border = sgr.border;
+  state.ideogram = sgr.ideogram;
+  state.font = sgr.font;
+  state.color = sgr.color;
+  state.bg_color = sgr.bg_color;
+  for(int i = 0; i < 4; ++i) {
+    state.color_extra[i] = sgr.color_extra[i];
+    state.bg_color_extra[i] = sgr.bg_color_extra[i];
+  }
+  return state;
+}
+/*
+ * Apply all the Control Sequences in a string to a state
+ *
+ * Like `FANSI_esc_to_html` this jumps from ESC to ESC with `strchr` so that
+ * only escape sequences are parsed.  `state.string` must be set.
+ *
+ * @param diag if NULL, `FANSI_read_next` is used so problems are signaled
+ *   as usual.  Otherwise the R-free `FANSI_read_next_core` is used and the
+ *   first problem is recorded in `diag` for `FANSI_diag_raise`, so this is
+ *   safe to use from worker threads.  Reading stops at fatal problems.
+ * @param elt index of the element being read, recorded in `diag`.
+ */
+struct FANSI_state FANSI_read_esc_all(
+  struct FANSI_state state, struct FANSI_diag * diag, R_xlen_t elt
+) {
+  const char * string = state.string + state.pos_byte;
+  while((string = strchr(string, 0x1b))) {
+    state.pos_byte = (int)(string - state.string);
+    if(diag) {
+      state = FANSI_read_next_core(state);
+      FANSI_diag_add(diag, elt, state);
+      if(state.err_code == FANSI_ERR_FATAL) break;
+    } else state = FANSI_read_next(state);
+    string = state.string + state.pos_byte;
+  }
+  return state;
+}
+/*
+ * Apply a delta to an SGR state
+ */
+struct FANSI_sgr FANSI_sgr_apply(
+  struct FANSI_sgr_delta delta, struct FANSI_sgr sgr
+) {
+  sgr.style = (sgr.style & ~delta.style_mask) |
+    (delta.sgr.style & delta.style_mask);
+  sgr.border = (sgr.border & ~delta.border_mask) |
+    (delta.sgr.border & delta.border_mask);
+  sgr.ideogram = (sgr.ideogram & ~delta.ideogram_mask) |
+    (delta.sgr.ideogram & delta.ideogram_mask);
+
+  if(delta.set & FANSI_SET_FONT) sgr.font = delta.sgr.font;
+  if(delta.set & FANSI_SET_COLOR) sgr.color = delta.sgr.color;
+  if(delta.set & FANSI_SET_BG_COLOR) sgr.bg_color = delta.sgr.bg_color;
+  if(delta.set & FANSI_SET_COLOR_EXTRA)
+    for(int i = 0; i < 4; ++i) sgr.color_extra[i] = delta.sgr.color_extra[i];
+  if(delta.set & FANSI_SET_BG_COLOR_EXTRA)
+    for(int i = 0; i < 4; ++i)
+      sgr.bg_color_extra[i] = delta.sgr.bg_color_extra[i];
+
+  return sgr;
+}
+/*
+ * Compose deltas, `first` followed by `second`
+ */
+static struct FANSI_sgr_delta delta_compose(
+  struct FANSI_sgr_delta first, struct FANSI_sgr_delta second
+) {
+  struct FANSI_sgr_delta res = {
+    .sgr = FANSI_sgr_apply(second, first.sgr),
+    .style_mask = first.style_mask | second.style_mask,
+    .border_mask = first.border_mask | second.border_mask,
+    .ideogram_mask = first.ideogram_mask | second.ideogram_mask,
+    .set = first.set | second.set
+  };
+  return res;
+}
+/*
+ * Compute the net SGR effect of a string
+ *
+ * @param state a state with `warn` set to zero and the desired `term_cap` and
+ *   `ctl` values.  SGR and position values are ignored.
+ * @param diag, elt see `FANSI_read_esc_all`.
+ */
+struct FANSI_sgr_delta FANSI_sgr_delta(
+  struct FANSI_state state, const char * string,
+  struct FANSI_diag * diag, R_xlen_t elt
+) {
+  struct FANSI_sgr blank = {.color=-1, .bg_color=-1};
+  struct FANSI_sgr sentinel = {
+    .style=FANSI_STYLE_ALL, .border=~0U, .ideogram=~0U,
+    .font=FANSI_SENTINEL,
+    .color=FANSI_SENTINEL, .bg_color=FANSI_SENTINEL,
+    .color_extra={FANSI_SENTINEL, 0, 0, 0},
+    .bg_color_extra={FANSI_SENTINEL, 0, 0, 0}
+  };
+  state = FANSI_reset_pos(state);
+  state.string = string;
+
+  struct FANSI_sgr res_b = FANSI_sgr_from_state(
+    FANSI_read_esc_all(FANSI_sgr_to_state(blank, state), diag, elt)
+  );
+  // Same sequences, so any problems were already recorded (or signaled)
+
+  struct FANSI_diag diag_s = {0};
+  struct FANSI_sgr res_s = FANSI_sgr_from_state(
+    FANSI_read_esc_all(FANSI_sgr_to_state(sentinel, state), &diag_s, elt)
+  );
+  // Bits that are not set are 0 in the blank result and 1 in the sentinel one
+
+  struct FANSI_sgr_delta delta = {
+    .sgr = res_s,
+    .style_mask = ~(~res_b.style & res_s.style) & FANSI_STYLE_ALL,
+    .border_mask = ~(~res_b.border & res_s.border),
+    .ideogram_mask = ~(~res_b.ideogram & res_s.ideogram),
+    .set = 0
+  };
+  if(res_s.font != FANSI_SENTINEL) delta.set |= FANSI_SET_FONT;
+  if(res_s.color != FANSI_SENTINEL) delta.set |= FANSI_SET_COLOR;
+  if(res_s.bg_color != FANSI_SENTINEL) delta.set |= FANSI_SET_BG_COLOR;
+  if(res_s.color_extra[0] != FANSI_SENTINEL)
+    delta.set |= FANSI_SET_COLOR_EXTRA;
+  if(res_s.bg_color_extra[0] != FANSI_SENTINEL)
+    delta.set |= FANSI_SET_BG_COLOR_EXTRA;
+
+  return delta;
+}
+/*
+ * Compute the SGR state each element starts with when carrying
+ *
+ * @param par as returned by `FANSI_par_init`, with `par.threads > 1`.
+ * @param state the state to start the first element with; its `term_cap` and
+ *   `ctl` values are used to read all elements.
+ * @param diag will be set to the first problem encountered, in element
+ *   order, for use with `FANSI_diag_raise`.
+ * @return an array `par.len + 1` long of the starting SGR state for each
+ *   element, with the last value the state at the end of the last element.
+ *   NA elements leave the state unchanged.
+ */
+struct FANSI_sgr * FANSI_carry_par(
+  struct FANSI_par par, struct FANSI_state state, struct FANSI_diag * diag
+) {
+  R_xlen_t len = par.len;
+  int threads = par.threads;
+
+  struct FANSI_sgr * sgr_in = (struct FANSI_sgr *)
+    R_alloc(len + 1, sizeof(struct FANSI_sgr));
+  struct FANSI_sgr_delta * deltas = (struct FANSI_sgr_delta *)
+    R_alloc(len, sizeof(struct FANSI_sgr_delta));
+  struct FANSI_sgr_delta * chunk_deltas = (struct FANSI_sgr_delta *)
+    R_alloc(threads, sizeof(struct FANSI_sgr_delta));
+  struct FANSI_diag * diags = (struct FANSI_diag *)
+    R_alloc(threads, sizeof(struct FANSI_diag));
+
+  struct FANSI_sgr_delta delta_id = {.set=0};
+  struct FANSI_state state_read = state;
+  state_read.warn = 0;
+
+  // - Phase 1: Net effect of each element, and of each chunk ----------------
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(static, 1)
+#endif
+  for(int k = 0; k < threads; ++k) {
+    struct FANSI_sgr_delta chunk_delta = delta_id;
+    diags[k] = (struct FANSI_diag) {.code=0};
+    for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+      if(par.chrs[i]) {
+        deltas[i] = FANSI_sgr_delta(state_read, par.chrs[i], diags + k, i);
+        chunk_delta = delta_compose(chunk_delta, deltas[i]);
+      } else deltas[i] = delta_id;
+    }
+    chunk_deltas[k] = chunk_delta;
+  }
+  // - Phase 2: Scan chunks, and then propagate within them -------------------
+
+  struct FANSI_sgr * chunk_in = (struct FANSI_sgr *)
+    R_alloc(threads + 1, sizeof(struct FANSI_sgr));
+  chunk_in[0] = FANSI_sgr_from_state(state);
+  for(int k = 0; k < threads; ++k)
+    chunk_in[k + 1] = FANSI_sgr_apply(chunk_deltas[k], chunk_in[k]);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(static, 1)
+#endif
+  for(int k = 0; k < threads; ++k) {
+    struct FANSI_sgr sgr = chunk_in[k];
+    for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+      sgr_in[i] = sgr;
+      sgr = FANSI_sgr_apply(deltas[i], sgr);
+  } }
+  sgr_in[len] = chunk_in[threads];
+
+  // Chunks are in element order, so the first problem is in the first chunk
+  // that has one, except fatal ones take precedence.
+
+  *diag = (struct FANSI_diag) {.code=0};
+  for(int k = 0; k < threads; ++k) {
+    if(diags[k].code == FANSI_ERR_FATAL) {
+      *diag = diags[k];
+      break;
+    }
+    if(!diag->code) *diag = diags[k];
+  }
+  return sgr_in;
+}
+/*
+ * Compute the SGR state at the end of each element
+ *
+ * Only ESC sequences are read; text bytes are skipped with `strchr`.
+ *
+ * @param carry whether the state at the end of each element should carry
+ *   over to the beginning of the next.
+ * @return character vector of the SGR sequences that reproduce the end state
+ *   of each element, or the empty string if there is no active style.
+ */
+SEXP FANSI_state_at_end(SEXP x, SEXP warn, SEXP term_cap, SEXP carry) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP || TYPEOF(carry) != LGLSXP
+  )
+    error("Internal error: input type error; contact maintainer"); // nocov
+
+  int carry_int = asLogical(carry);
+  R_xlen_t x_len = XLENGTH(x);
+  struct FANSI_state state_init = FANSI_state_init("", warn, term_cap);
+  struct FANSI_sgr sgr_init = FANSI_sgr_from_state(state_init);
+  struct FANSI_sgr * sgr_end = NULL;
+
+  struct FANSI_par par = FANSI_par_init(x, FANSI_threads());
+  if(par.threads > 1) {
+    struct FANSI_diag * diags = (struct FANSI_diag *)
+      R_alloc(par.threads, sizeof(struct FANSI_diag));
+    R_xlen_t diags_n = 1;
+    if(carry_int) {
+      sgr_end = FANSI_carry_par(par, state_init, diags) + 1;
+    } else {
+      diags_n = par.threads;
+      sgr_end = (struct FANSI_sgr *) R_alloc(x_len, sizeof(struct FANSI_sgr));
+      struct FANSI_state state_read = state_init;
+      state_read.warn = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+      for(int k = 0; k < par.threads; ++k) {
+        diags[k] = (struct FANSI_diag) {.code=0};
+        for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+          if(!par.chrs[i]) continue;
+          struct FANSI_state state = state_read;
+          state.string = par.chrs[i];
+          sgr_end[i] = FANSI_sgr_from_state(
+            FANSI_read_esc_all(state, diags + k, i)
+          );
+      } }
+    }
+    FANSI_diag_raise(diags, diags_n, state_init.warn);
+  }
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  SEXP res_chr, res_chr_prev = R_BlankString;
+  struct FANSI_state state = state_init, state_prev = state_init;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chrsxp = STRING_ELT(x, i);
+    if(chrsxp == NA_STRING) {
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    if(sgr_end) {
+      state = FANSI_sgr_to_state(sgr_end[i], state);
+    } else {
+      // Keep `warn` from the prior element so we only warn once
+      FANSI_check_chrsxp(chrsxp, i);
+      if(!carry_int) state = FANSI_sgr_to_state(sgr_init, state);
+      state = FANSI_reset_pos(state);
+      state.string = CHAR(chrsxp);
+      state = FANSI_read_esc_all(state, NULL, i);
+    }
+    // Many elements will share the same end state
+    if(FANSI_state_comp(state, state_prev)) {
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+      res_chr = PROTECT(mkChar(FANSI_state_as_chr(state)));
+    } else {
+      res_chr = PROTECT(res_chr_prev);
+    }
+    SET_STRING_ELT(res, i, res_chr);
+    UNPROTECT(1);
+    res_chr_prev = res_chr;
+    state_prev = state;
+  }
+  UNPROTECT(1);
+  return res;
+}
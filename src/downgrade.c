@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include <stdlib.h>
+#include "fansi.h"
+
+/*
+ * Map colors onto those supported by less capable terminals
+ *
+ * Colors are quantized via lookup tables indexed by the color reduced to 15
+ * bits (5 bits per channel, "RGB555"), so each lookup is a few shifts.  The
+ * tables are built the first time they are needed.  The 8-bit palette values
+ * are the xterm defaults.
+ */
+
+#define LUT_SIZE 32768
+
+static const unsigned char basic_rgb[16][3] = {
+  {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+  {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+  {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+  {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+};
+static const int cube_lvl[6] = {0, 95, 135, 175, 215, 255};
+
+static unsigned char lut_256[LUT_SIZE];
+static unsigned char lut_16[LUT_SIZE];
+static unsigned char lut_8[LUT_SIZE];
+static int lut_256_init, lut_16_init, lut_8_init;
+
+static void palette_rgb(int idx, int * rgb) {
+  if(idx < 16) {
+    for(int i = 0; i < 3; ++i) rgb[i] = basic_rgb[idx][i];
+  } else if(idx < 232) {
+    idx -= 16;
+    rgb[0] = cube_lvl[idx / 36];
+    rgb[1] = cube_lvl[(idx / 6) % 6];
+    rgb[2] = cube_lvl[idx % 6];
+  } else {
+    rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (idx - 232);
+  }
+}
+static int rgb_key(int r, int g, int b) {
+  return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+// Center of the RGB555 bucket, expanded back to 8 bits per channel
+
+static void key_rgb(int key, int * rgb) {
+  for(int i = 0; i < 3; ++i) {
+    int c = (key >> (5 * (2 - i))) & 31;
+    rgb[i] = (c << 3) | (c >> 2);
+  }
+}
+static int dist(const int * a, const int * b) {
+  int d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+  return d0 * d0 + d1 * d1 + d2 * d2;
+}
+/*
+ * The 6x6x6 cube is separable so the nearest cube color is the nearest level
+ * in each channel; compare that to the nearest of the 24 grays.
+ */
+static void build_lut_256() {
+  for(int key = 0; key < LUT_SIZE; ++key) {
+    int rgb[3], cube[3], lvl[3];
+    key_rgb(key, rgb);
+    for(int i = 0; i < 3; ++i) {
+      int best = 0;
+      for(int j = 1; j < 6; ++j)
+        if(abs(cube_lvl[j] - rgb[i]) < abs(cube_lvl[best] - rgb[i])) best = j;
+      lvl[i] = best;
+      cube[i] = cube_lvl[best];
+    }
+    int avg = (rgb[0] + rgb[1] + rgb[2]) / 3;
+    int gray_idx = avg < 8 ? 0 : (avg - 8 + 5) / 10;
+    if(gray_idx > 23) gray_idx = 23;
+    int gray[3];
+    palette_rgb(232 + gray_idx, gray);
+
+    lut_256[key] = (unsigned char) (
+      dist(rgb, gray) < dist(rgb, cube) ?
+        232 + gray_idx : 16 + 36 * lvl[0] + 6 * lvl[1] + lvl[2]
+    );
+  }
+  lut_256_init = 1;
+}
+static void build_lut_basic(unsigned char * lut, int n) {
+  for(int key = 0; key < LUT_SIZE; ++key) {
+    int rgb[3], pal[3], best = 0, best_d = INT_MAX;
+    key_rgb(key, rgb);
+    for(int idx = 0; idx < n; ++idx) {
+      palette_rgb(idx, pal);
+      int d = dist(rgb, pal);
+      if(d < best_d) {
+        best_d = d;
+        best = idx;
+    } }
+    lut[key] = (unsigned char) best;
+  }
+}
+/*
+ * Downgrade a single color
+ *
+ * @param bg whether this is a background color
+ * @param cap the target capabilities, see FANSI_TERM_*
+ */
+static void downgrade_color(int * color, int * extra, int bg, int cap) {
+  int key = -1, idx = -1;
+
+  if(*color == 8 && extra[0] == 2 && !(cap & FANSI_TERM_TRUECOLOR)) {
+    key = rgb_key(extra[1], extra[2], extra[3]);
+    if(cap & FANSI_TERM_256) {
+      if(!lut_256_init) build_lut_256();
+      extra[0] = 5;
+      extra[1] = lut_256[key];
+      extra[2] = extra[3] = 0;
+      return;
+    }
+  } else if(*color == 8 && extra[0] == 5 && !(cap & FANSI_TERM_256)) {
+    int rgb[3];
+    palette_rgb(extra[1], rgb);
+    if(cap & FANSI_TERM_TRUECOLOR) {
+      extra[0] = 2;
+      for(int i = 0; i < 3; ++i) extra[i + 1] = rgb[i];
+      return;
+    }
+    if(extra[1] < 16) idx = extra[1];
+    else key = rgb_key(rgb[0], rgb[1], rgb[2]);
+  } else if(!(cap & FANSI_TERM_BRIGHT) && *color >= 90 && *color <= 97) {
+    idx = *color - 90 + 8;
+  } else if(!(cap & FANSI_TERM_BRIGHT) && *color >= 100 && *color <= 107) {
+    idx = *color - 100 + 8;
+  } else return;
+
+  if(key >= 0) {
+    if(cap & FANSI_TERM_BRIGHT) {
+      if(!lut_16_init) {
+        build_lut_basic(lut_16, 16);
+        lut_16_init = 1;
+      }
+      idx = lut_16[key];
+    } else {
+      if(!lut_8_init) {
+        build_lut_basic(lut_8, 8);
+        lut_8_init = 1;
+      }
+      idx = lut_8[key];
+    }
+  }
+  if(idx >= 8 && !(cap & FANSI_TERM_BRIGHT)) idx -= 8;
+  if(idx < 8) *color = idx;
+  else *color = (bg ? 100 : 90) + idx - 8;
+  for(int i = 0; i < 4; ++i) extra[i] = 0;
+}
+/*
+ * Downgrade the colors of a state to those supported by `cap`
+ *
+ * @param cap the target capabilities, see FANSI_TERM_*
+ */
+struct FANSI_state FANSI_state_downgrade(struct FANSI_state state, int cap) {
+  downgrade_color(&state.color, state.color_extra, 0, cap);
+  downgrade_color(&state.bg_color, state.bg_color_extra, 1, cap);
+  return state;
+}
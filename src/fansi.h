@@ -38,25 +38,62 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   #define FANSI_CTL_ESC 16
   #define FANSI_CTL_ALL 31 // 1 + 2 + 4 + 8 + 16 == 2^0 + 2^1 + 2^2 + 2^3 + 2^4
 
+  // `err_code` for problems that must become R errors, see read.c
+
+  #define FANSI_ERR_FATAL 10
+
   #define FANSI_STYLE_MAX 12 // 12 is double underline
 
   #define FANSI_TERM_BRIGHT 1
   #define FANSI_TERM_256 2
   #define FANSI_TERM_TRUECOLOR 4
 
+  #define FANSI_SET_FONT 1
+  #define FANSI_SET_COLOR 2
+  #define FANSI_SET_BG_COLOR 4
+  #define FANSI_SET_COLOR_EXTRA 8
+  #define FANSI_SET_BG_COLOR_EXTRA 16
+
   // symbols
 
   extern SEXP FANSI_warn_sym;
+  extern SEXP FANSI_threads_sym;
+  extern SEXP FANSI_opts_sym;
 
 
   // macros
 
   #define FANSI_ADD_INT(x, y) FANSI_add_int((x), (y), __FILE__, __LINE__)
 
+  // Instrumentation counters, only compiled in if FANSI_PERF is defined, e.g.
+  // with `PKG_CPPFLAGS=-DFANSI_PERF` in ~/.R/Makevars.  See utils.c.
+
+  #define FANSI_PERF_READ_NEXT 0   // FANSI_read_next calls
+  #define FANSI_PERF_NCHAR 1       // R_nchar width lookups
+  #define FANSI_PERF_BUFF 2        // FANSI_size_buff allocations
+  #define FANSI_PERF_MKCHAR 3      // CHARSXPs created
+  #define FANSI_PERF_BYTES 4       // bytes read or scanned
+  #define FANSI_PERF_N 5
+
+  #ifdef FANSI_PERF
+  #ifdef _OPENMP
+  #define FANSI_PERF_ADD(counter, n) \
+    do { _Pragma("omp atomic") FANSI_perf[counter] += (n); } while(0)
+  #else
+  #define FANSI_PERF_ADD(counter, n) \
+    do { FANSI_perf[counter] += (n); } while(0)
+  #endif
+  #else
+  #define FANSI_PERF_ADD(counter, n) do {} while(0)
+  #endif
+
   // Global variables (see utils.c)
 
   extern int FANSI_int_max;
   extern int FANSI_int_min;  // no way to change this externally
+  #ifdef FANSI_PERF
+  extern double FANSI_perf[FANSI_PERF_N];
+  #endif
 
   // - Structs -----------------------------------------------------------------
   /*
@@ -68,6 +105,36 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   struct FANSI_buff {
     char * buff; // Buffer
     size_t len;     // How many bytes the buffer has been allocated to
+    int pool;       // Pool slot + 1 if from the pool (see pool.c), else 0
+  };
+  /*
+   * Resolved `fansi_opts` settings, see opts.c.
+   */
+  struct FANSI_opts {
+    int warn;
+    int term_cap;        // bit mask, as in `FANSI_state`
+    int ctl;             // bit mask, as in `FANSI_state`
+    int tabs_as_spaces;
+  };
+  /*
+   * Bump allocator for transient per-call data, see `FANSI_arena_alloc`.
+   */
+  struct FANSI_arena {
+    char * block;   // current block
+    size_t used;    // bytes of `block` handed out
+    size_t len;     // size of `block`
+  };
+  /*
+   * Describes how to split element-wise work across threads, see threads.c
+   */
+  struct FANSI_par {
+    const char ** chrs;   // CHAR() of each element, NULL for NA
+    int * lens;           // LENGTH() of each element
+    size_t * offs;        // cumulative bytes preceding each element
+    R_xlen_t * bounds;    // first element of each chunk, `threads + 1` long
+    R_xlen_t len;         // number of elements
+    size_t total;         // total bytes
+    int threads;          // 1 means don't use threads
   };
   struct FANSI_string_as_utf8 {
     const char * string;  // buffer
@@ -253,6 +320,8 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
      * * 7: malformed escape
      * * 8: c0 escapes
      * * 9: malformed UTF8
+     * * 10: (FANSI_ERR_FATAL) internal error or invalid input, `err_msg`
+     *     describes it; `FANSI_read_next` turns these into R errors
      */
     int err_code;
     /*
@@ -285,11 +354,51 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
     int keepNA;
     // invalid multi-byte char, a bit of duplication with err_code = 9;
     int nchar_err;
+    // Byte size of the UTF-8 char just read by `FANSI_read_next_core` in
+    // `use_nchar` mode, whose width still needs to be looked up, else 0
+    int width_pending;
     // what types of Control Sequences should have special treatment.  This
     // mirrors the `ctl` parameter for `FANSI_find_esc`.  See `FANSI_ctl_as_int`
     // for the encoding.
     int ctl;
   };
+  /*
+   * Just the SGR portion of a FANSI_state, see FANSI_state for details
+   */
+  struct FANSI_sgr {
+    int color_extra[4];
+    int bg_color_extra[4];
+    unsigned int style;
+    unsigned int border;
+    unsigned int ideogram;
+    int font;
+    int color;
+    int bg_color;
+  };
+  /*
+   * Net effect of a string on SGR state, see carry.c
+   *
+   * The `*_mask` members mark which bits of the corresponding `sgr` bit masks
+   * are set by the string, and `set` which of the other attributes are (see
+   * FANSI_SET_* flags).
+   */
+  struct FANSI_sgr_delta {
+    struct FANSI_sgr sgr;
+    unsigned int style_mask;
+    unsigned int border_mask;
+    unsigned int ideogram_mask;
+    int set;
+  };
+  /*
+   * First problem found by the R-free parser in an element (or chunk), see
+   * `FANSI_diag_add`; `code` is 0 if there were none.
+   */
+  struct FANSI_diag {
+    R_xlen_t elt;
+    int pos;              // byte offset after the offending sequence
+    int code;             // `err_code`
+    const char * msg;     // `err_msg`
+  };
   /*
    * Need to keep track of fallback state, so we need ability to return two
    * states
@@ -322,7 +431,8 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
     SEXP strip_spaces,
     SEXP tabs_as_spaces, SEXP tab_stops,
     SEXP warn, SEXP term_cap,
-    SEXP first_only, SEXP ctl
+    SEXP first_only, SEXP ctl, SEXP carry,
+    SEXP terminate, SEXP normalize
   );
   SEXP FANSI_process(SEXP input, struct FANSI_buff * buff);
   SEXP FANSI_process_ext(SEXP input);
@@ -331,13 +441,38 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   );
   SEXP FANSI_color_to_html_ext(SEXP x);
   SEXP FANSI_esc_to_html(SEXP x, SEXP warn, SEXP term_cap, SEXP class_pre);
+  SEXP FANSI_state_at_end(SEXP x, SEXP warn, SEXP term_cap, SEXP carry);
   SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap);
 
   SEXP FANSI_nchar(
-    SEXP x, SEXP type, SEXP allowNA, SEXP keepNA, SEXP warn, SEXP term_cap
+    SEXP x, SEXP type, SEXP allowNA, SEXP keepNA, SEXP warn, SEXP term_cap,
+    SEXP ctl
+  );
+  SEXP FANSI_nchar_int(
+    SEXP x, int type, int allowNA, int keepNA, int warn, int ctl
   );
   SEXP FANSI_nzchar(SEXP x, SEXP keepNA, SEXP warn, SEXP term_cap, SEXP ctl);
-  SEXP FANSI_strsplit(SEXP x, SEXP warn, SEXP term_cap);
+  SEXP FANSI_strsplit(
+    SEXP x, SEXP matches, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry
+  );
+  SEXP FANSI_split_lines(
+    SEXP x, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry
+  );
+  SEXP FANSI_match_map(SEXP x, SEXP matches, SEXP ctl);
+  SEXP FANSI_highlight(
+    SEXP x, SEXP start, SEXP stop, SEXP style, SEXP warn, SEXP term_cap,
+    SEXP ctl
+  );
+  SEXP FANSI_normalize(SEXP x, SEXP warn, SEXP term_cap);
+  SEXP FANSI_sgr_close(SEXP x, SEXP term_cap);
+  SEXP FANSI_downgrade(SEXP x, SEXP warn, SEXP term_cap);
+  SEXP FANSI_filter_sgr(SEXP x, SEXP keep, SEXP warn, SEXP term_cap);
+  SEXP FANSI_squash(SEXP x, SEXP warn, SEXP term_cap);
+  SEXP FANSI_ctl_runs(SEXP x, SEXP warn, SEXP term_cap, SEXP ctl);
+  SEXP FANSI_runs_to_ctl(
+    SEXP x, SEXP elt, SEXP byte_start, SEXP byte_stop, SEXP style,
+    SEXP styles, SEXP term_cap, SEXP terminate
+  );
   SEXP FANSI_tabs_as_spaces(
     SEXP vec, SEXP tab_stops, struct FANSI_buff * buff, SEXP warn,
     SEXP term_cap, SEXP ctl
@@ -357,7 +492,34 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
 
   SEXP FANSI_set_int_max(SEXP x);
   SEXP FANSI_get_int_max();
+  SEXP FANSI_perf_counters(SEXP reset);
   SEXP FANSI_esc_html(SEXP x);
+  SEXP FANSI_term_cap_idx(SEXP term_cap);
+  SEXP FANSI_ctl_idx(SEXP ctl);
+  SEXP FANSI_substr_args(
+    SEXP x, SEXP start, SEXP stop, SEXP type, SEXP round,
+    SEXP tabs_as_spaces, SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl,
+    SEXP carry, SEXP terminate, SEXP normalize, SEXP opts
+  );
+  SEXP FANSI_nchar_ctl(
+    SEXP x, SEXP type, SEXP allowNA, SEXP keepNA, SEXP warn, SEXP ctl,
+    SEXP opts
+  );
+  SEXP FANSI_strwrap_ctl(
+    SEXP x, SEXP width, SEXP indent, SEXP exdent, SEXP prefix, SEXP initial,
+    SEXP wrap_always, SEXP pad_end, SEXP strip_spaces, SEXP tabs_as_spaces,
+    SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry,
+    SEXP terminate, SEXP normalize, SEXP opts
+  );
+  SEXP FANSI_opts_make(
+    SEXP warn, SEXP term_cap, SEXP ctl, SEXP tabs_as_spaces, SEXP tab_stops
+  );
+  SEXP FANSI_opts_args(SEXP opts);
+  SEXP FANSI_opts_sgr(SEXP opts);
+  SEXP FANSI_api_substr_ext(
+    SEXP x, SEXP start, SEXP stop, SEXP type, SEXP round, SEXP term_cap,
+    SEXP ctl, SEXP warn
+  );
 
   // - Internal funs -----------------------------------------------------------
 
@@ -373,6 +535,19 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   SEXP FANSI_ctl_as_int_ext(SEXP ctl);
 
   void FANSI_size_buff(struct FANSI_buff * buff, size_t size);
+  void * FANSI_arena_alloc(struct FANSI_arena * arena, size_t size);
+  void FANSI_buff_pool(struct FANSI_buff * buff);
+  void FANSI_buff_release(struct FANSI_buff * buff);
+  void FANSI_pool_size(struct FANSI_buff * buff, size_t size);
+  SEXP FANSI_with_buff(
+    SEXP (*fun)(void *), void * data, struct FANSI_buff * buff
+  );
+  void FANSI_pool_free();
+  void FANSI_api_register(void);
+  void FANSI_opts_free();
+  struct FANSI_opts FANSI_opts_get(SEXP opts);
+  int FANSI_arg_flag(SEXP x, const char * name, const char * err);
+  SEXP FANSI_arg_tab_stops(SEXP x);
 
   int FANSI_pmatch(
     SEXP x, const char ** choices, int choice_count, const char * arg_name
@@ -380,6 +555,8 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
 
   int FANSI_is_utf8_loc();
   int FANSI_utf8clen(char c);
+  int FANSI_utf8_count(const char * x, int len);
+  int FANSI_utf8_width(const char * x, int len);
   int FANSI_digits_in_int(int x);
   struct FANSI_string_as_utf8 FANSI_string_as_utf8(SEXP x);
   struct FANSI_state FANSI_state_init(
@@ -389,6 +566,11 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
     const char * string, SEXP warn, SEXP term_cap, SEXP allowNA, SEXP keepNA,
     SEXP width, SEXP ctl
   );
+  struct FANSI_opts FANSI_opts_sxp(SEXP warn, SEXP term_cap, SEXP ctl);
+  struct FANSI_state FANSI_state_init_opts(
+    const char * string, struct FANSI_opts opts, int allowNA, int keepNA,
+    int width
+  );
   int FANSI_state_comp(struct FANSI_state target, struct FANSI_state current);
   int FANSI_state_comp_color(
     struct FANSI_state target, struct FANSI_state current
@@ -402,8 +584,22 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   );
   int FANSI_state_size(struct FANSI_state state);
   int FANSI_csi_write(char * buff, struct FANSI_state state, int buff_len);
+  int FANSI_csi_delta_write(
+    char * buff, struct FANSI_state from, struct FANSI_state to, int normalize
+  );
+  char * FANSI_state_as_chr(struct FANSI_state state);
+  char * FANSI_state_as_chr_arena(
+    struct FANSI_state state, struct FANSI_arena * arena
+  );
+  struct FANSI_state FANSI_state_downgrade(struct FANSI_state state, int cap);
 
   struct FANSI_state FANSI_read_next(struct FANSI_state state);
+  struct FANSI_state FANSI_read_next_core(struct FANSI_state state);
+  const char * FANSI_err_msg(int code);
+  void FANSI_diag_add(
+    struct FANSI_diag * diag, R_xlen_t elt, struct FANSI_state state
+  );
+  void FANSI_diag_raise(const struct FANSI_diag * diags, R_xlen_t n, int warn);
 
   int FANSI_add_int(int x, int y, const char * file, int line);
 
@@ -414,6 +610,27 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
   intmax_t FANSI_ind(R_xlen_t i);
   void FANSI_check_chr_size(char * start, char * end, R_xlen_t i);
 
+  int FANSI_threads();
+  struct FANSI_par FANSI_par_init(SEXP x, int threads);
+
+  struct FANSI_sgr FANSI_sgr_from_state(struct FANSI_state state);
+  struct FANSI_state FANSI_sgr_to_state(
+    struct FANSI_sgr sgr, struct FANSI_state state
+  );
+  struct FANSI_state FANSI_read_esc_all(
+    struct FANSI_state state, struct FANSI_diag * diag, R_xlen_t elt
+  );
+  struct FANSI_sgr FANSI_sgr_apply(
+    struct FANSI_sgr_delta delta, struct FANSI_sgr sgr
+  );
+  struct FANSI_sgr_delta FANSI_sgr_delta(
+    struct FANSI_state state, const char * string,
+    struct FANSI_diag * diag, R_xlen_t elt
+  );
+  struct FANSI_sgr * FANSI_carry_par(
+    struct FANSI_par par, struct FANSI_state state, struct FANSI_diag * diag
+  );
+
   // - Compatibility -----------------------------------------------------------
 
   // R_nchar does not exist prior to 3.2.2, so we sub in this dummy
@@ -425,4 +642,10 @@ Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
               Rboolean allowNA, Rboolean keepNA, const char* msg_name);
   #endif
 
+  // MARK_NOT_MUTABLE is only available from R 3.5.0
+
+  #ifndef MARK_NOT_MUTABLE
+  #define MARK_NOT_MUTABLE(x) SET_NAMED((x), 2)
+  #endif
+
 #endif
@@ -22,13 +22,16 @@
 
 #include "fansi.h"
 
+// No R API use so this is safe to call from worker threads
+
+static int has_chr(const char * x, int ctl) {
+  struct FANSI_csi_pos pos = FANSI_find_esc(x, ctl);
+  return (pos.valid ? 1 : -1) * (pos.len != 0);
+}
 int FANSI_has_int(SEXP x, int ctl) {
   if(TYPEOF(x) != CHARSXP) error("Argument `x` must be CHRSXP.");
   if(x == NA_STRING) return NA_LOGICAL;
-  else {
-    struct FANSI_csi_pos pos = FANSI_find_esc(CHAR(x), ctl);
-    return (pos.valid ? 1 : -1) * (pos.len != 0);
-  }
+  else return has_chr(CHAR(x), ctl);
 }
 /*
  * Check if a CHARSXP contains ANSI esc sequences
@@ -43,12 +46,27 @@ SEXP FANSI_has(SEXP x, SEXP ctl, SEXP warn) {
   int warn_int = asLogical(warn);
 
   int ctl_int = FANSI_ctl_as_int(ctl);
+  struct FANSI_par par = FANSI_par_init(x, FANSI_threads());
 
+  if(par.threads > 1) {
+    // Workers only compute; warnings are issued below on the main thread
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+    for(int k = 0; k < par.threads; ++k) {
+      for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+        res_int[i] = par.chrs[i] ? has_chr(par.chrs[i], ctl_int) : NA_LOGICAL;
+  } } }
   for(R_xlen_t i = 0; i < len; ++i) {
     FANSI_interrupt(i);
-    SEXP chrsxp = STRING_ELT(x, i);
-    FANSI_check_chrsxp(chrsxp, i);
-    int res_tmp = FANSI_has_int(chrsxp, ctl_int);
+    int res_tmp;
+    if(par.threads > 1) res_tmp = res_int[i];
+    else {
+      SEXP chrsxp = STRING_ELT(x, i);
+      FANSI_check_chrsxp(chrsxp, i);
+      res_tmp = FANSI_has_int(chrsxp, ctl_int);
+    }
     // no great, but need to watch out for NA_LOGICAL == INT_MIN
     if(res_tmp == -1 && warn_int) {
       res_tmp = -res_tmp;
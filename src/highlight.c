@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Apply an SGR style to ranges of characters
+ *
+ * Each element is scanned once.  We track both the SGR state of the input
+ * (`state`), and the state the output has set so far (`term`).  Before each
+ * visible character we compute the state it should be shown with, which is
+ * the input state with the highlight applied over it if the character is in a
+ * range, and if that differs from `term` we write the delta between them.
+ * Escape sequences in the input are copied as is, and also applied to `term`
+ * so that it stays in sync with what the terminal will see.
+ *
+ * Overlapping ranges are merged, so a character is highlighted if it is in
+ * any of the ranges.
+ */
+
+struct hl_range {
+  int start;
+  int stop;
+};
+
+static int hl_range_comp(const void * a, const void * b) {
+  const struct hl_range * x = a, * y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+/*
+ * Sort and merge ranges in place, dropping empty and NA ones
+ *
+ * @return the number of merged ranges
+ */
+static int hl_merge(struct hl_range * rng, int n) {
+  int valid = 0;
+  for(int k = 0; k < n; ++k) {
+    struct hl_range r = rng[k];
+    if(r.start == NA_INTEGER || r.stop == NA_INTEGER) continue;
+    if(r.start < 1) r.start = 1;
+    if(r.stop < r.start) continue;
+    rng[valid++] = r;
+  }
+  if(valid < 2) return valid;
+  qsort(rng, valid, sizeof(struct hl_range), hl_range_comp);
+
+  int merged = 0;
+  for(int k = 1; k < valid; ++k) {
+    // ranges are inclusive of both ends, so adjacent ranges merge too
+    if(rng[k].start - 1 <= rng[merged].stop) {
+      if(rng[k].stop > rng[merged].stop) rng[merged].stop = rng[k].stop;
+    } else rng[++merged] = rng[k];
+  }
+  return merged + 1;
+}
+static struct FANSI_state hl_overlay(
+  struct FANSI_state state, struct FANSI_sgr_delta hl
+) {
+  return FANSI_sgr_to_state(
+    FANSI_sgr_apply(hl, FANSI_sgr_from_state(state)), state
+  );
+}
+/*
+ * Compute the size of, or write, the highlighted element
+ *
+ * @param buff where to write, or NULL to only compute the size.  Does not
+ *   write the NULL terminator.
+ * @param state_end set to the input state at the end of the element.
+ * @return the size of the highlighted string.
+ */
+static int hl_walk(
+  struct FANSI_state state, const struct hl_range * rng, int n,
+  struct FANSI_sgr_delta hl, char * buff, struct FANSI_state * state_end
+) {
+  struct FANSI_state term = state;
+  size_t size = 0;
+  int k = 0;
+
+  while(state.string[state.pos_byte]) {
+    struct FANSI_state next = FANSI_read_next(state);
+    int bytes = next.pos_byte - state.pos_byte;
+    int delta = 0;
+
+    if(next.pos_raw != state.pos_raw) {
+      // Visible character; `pos_raw` is its 1 based index
+
+      int chr = next.pos_raw;
+      while(k < n && rng[k].stop < chr) ++k;
+      struct FANSI_state want =
+        k < n && rng[k].start <= chr ? hl_overlay(state, hl) : state;
+
+      delta = FANSI_csi_delta_write(buff ? buff + size : NULL, term, want, 0);
+      term = FANSI_state_copy_style(term, want);
+    } else {
+      // Zero width sequence; apply it to what the output has set
+
+      struct FANSI_state term_read = FANSI_state_copy_style(state, term);
+      term_read.warn = 0;
+      term = FANSI_state_copy_style(term, FANSI_read_next(term_read));
+    }
+    if(buff) memcpy(buff + size + delta, state.string + state.pos_byte, bytes);
+    size += (size_t) delta + (size_t) bytes;
+    if(size > (size_t) FANSI_int_max)
+      error(
+        "%s%s",
+        "Attempting to create string longer than INT_MAX while adding ",
+        "highlighting CSI SGR sequences."
+      );
+    state = next;
+  }
+  // Restore what the input has set at the end
+
+  int delta = FANSI_csi_delta_write(buff ? buff + size : NULL, term, state, 0);
+  if(size > (size_t) (FANSI_int_max - delta))
+    error(
+      "%s%s",
+      "Attempting to create string longer than INT_MAX while adding ",
+      "highlighting CSI SGR sequences."
+    );
+  *state_end = state;
+  return (int) size + delta;
+}
+/*
+ * @param x a character vector, already in UTF-8
+ * @param start, stop either integer vectors the same length as `x` with one
+ *   range per element, or lists the same length as `x` of integer vectors
+ *   with any number of ranges per element.
+ * @param style a scalar character vector containing SGR sequences only.
+ */
+SEXP FANSI_highlight(
+  SEXP x, SEXP start, SEXP stop, SEXP style, SEXP warn, SEXP term_cap,
+  SEXP ctl
+) {
+  R_xlen_t x_len = XLENGTH(x);
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(start) != TYPEOF(stop) ||
+    (TYPEOF(start) != INTSXP && TYPEOF(start) != VECSXP) ||
+    XLENGTH(start) != x_len || XLENGTH(stop) != x_len ||
+    TYPEOF(style) != STRSXP || XLENGTH(style) != 1 ||
+    STRING_ELT(style, 0) == NA_STRING ||
+    TYPEOF(warn) != LGLSXP || TYPEOF(term_cap) != INTSXP ||
+    TYPEOF(ctl) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  int is_list = TYPEOF(start) == VECSXP;
+  int warned = 0;
+
+  SEXP R_false = PROTECT(ScalarLogical(0));
+  struct FANSI_opts opts = FANSI_opts_sxp(warn, term_cap, ctl);
+
+  struct FANSI_sgr_delta hl = FANSI_sgr_delta(
+    FANSI_state_init("", R_false, term_cap), CHAR(STRING_ELT(style, 0)), NULL, 0
+  );
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+  struct hl_range * rng = NULL;
+  R_xlen_t rng_cap = 0;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    SET_STRING_ELT(res, i, chr);
+    if(chr == NA_STRING) continue;
+    FANSI_check_chrsxp(chr, i);
+
+    // Collect the ranges for this element
+
+    const int * starts, * stops;
+    R_xlen_t n;
+    if(is_list) {
+      SEXP start_i = VECTOR_ELT(start, i);
+      SEXP stop_i = VECTOR_ELT(stop, i);
+      if(
+        TYPEOF(start_i) != INTSXP || TYPEOF(stop_i) != INTSXP ||
+        XLENGTH(start_i) != XLENGTH(stop_i)
+      )
+        error("Internal Error: bad range data; contact maintainer."); // nocov
+      starts = INTEGER(start_i);
+      stops = INTEGER(stop_i);
+      n = XLENGTH(start_i);
+    } else {
+      starts = INTEGER(start) + i;
+      stops = INTEGER(stop) + i;
+      n = 1;
+    }
+    if(n > FANSI_int_max)
+      error("Too many highlight ranges for element %jd.", FANSI_ind(i));
+    if(n > rng_cap) {
+      rng_cap = n > 2 * rng_cap ? n : 2 * rng_cap;
+      if(rng_cap > FANSI_int_max) rng_cap = FANSI_int_max;
+      rng = (struct hl_range *) R_alloc(rng_cap, sizeof(struct hl_range));
+    }
+    for(R_xlen_t k = 0; k < n; ++k) {
+      rng[k].start = starts[k];
+      rng[k].stop = stops[k];
+    }
+    int rng_n = hl_merge(rng, (int) n);
+    if(!rng_n) continue;
+
+    struct FANSI_state state = FANSI_state_init_opts(CHAR(chr), opts, 1, 1, 0);
+    if(warned) state.warn = -state.warn;
+
+    // Measure, then write
+
+    struct FANSI_state state_end;
+    int size = hl_walk(state, rng, rng_n, hl, NULL, &state_end);
+    warned = warned || state_end.warn < 0;
+    FANSI_size_buff(&buff, (size_t) size + 1);
+    state.warn = 0;
+    hl_walk(state, rng, rng_n, hl, buff.buff, &state_end);
+    buff.buff[size] = 0;
+
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SET_STRING_ELT(res, i, mkCharLenCE(buff.buff, size, getCharCE(chr)));
+  }
+  UNPROTECT(2);
+  return res;
+}
@@ -23,7 +23,7 @@ static const
 R_CallMethodDef callMethods[] = {
   {"has_csi", (DL_FUNC) &FANSI_has, 3},
   {"strip_csi", (DL_FUNC) &FANSI_strip, 3},
-  {"strwrap_csi", (DL_FUNC) &FANSI_strwrap_ext, 15},
+  {"strwrap_csi", (DL_FUNC) &FANSI_strwrap_ext, 18},
   {"state_at_pos_ext", (DL_FUNC) &FANSI_state_at_pos_ext, 8},
   {"process", (DL_FUNC) &FANSI_process_ext, 1},
   {"check_assumptions", (DL_FUNC) &FANSI_check_assumptions, 0},
@@ -31,24 +31,48 @@ R_CallMethodDef callMethods[] = {
   {"tabs_as_spaces", (DL_FUNC) &FANSI_tabs_as_spaces_ext, 5},
   {"color_to_html", (DL_FUNC) &FANSI_color_to_html_ext, 1},
   {"esc_to_html", (DL_FUNC) &FANSI_esc_to_html, 4},
+  {"state_at_end", (DL_FUNC) &FANSI_state_at_end, 4},
   {"unhandled_esc", (DL_FUNC) &FANSI_unhandled_esc, 2},
   {"unique_chr", (DL_FUNC) &FANSI_unique_chr, 1},
   {"nzchar_esc", (DL_FUNC) &FANSI_nzchar, 5},
+  {"nchar_esc", (DL_FUNC) &FANSI_nchar, 7},
   {"add_int", (DL_FUNC) &FANSI_add_int_ext, 2},
-  {"strsplit", (DL_FUNC) &FANSI_strsplit, 3},
+  {"strsplit", (DL_FUNC) &FANSI_strsplit, 6},
+  {"split_lines", (DL_FUNC) &FANSI_split_lines, 5},
+  {"match_map", (DL_FUNC) &FANSI_match_map, 3},
+  {"highlight", (DL_FUNC) &FANSI_highlight, 7},
+  {"normalize", (DL_FUNC) &FANSI_normalize, 3},
+  {"sgr_close", (DL_FUNC) &FANSI_sgr_close, 2},
+  {"downgrade", (DL_FUNC) &FANSI_downgrade, 3},
+  {"filter_sgr", (DL_FUNC) &FANSI_filter_sgr, 4},
+  {"squash", (DL_FUNC) &FANSI_squash, 3},
+  {"ctl_runs", (DL_FUNC) &FANSI_ctl_runs, 4},
+  {"runs_to_ctl", (DL_FUNC) &FANSI_runs_to_ctl, 8},
   {"cleave", (DL_FUNC) &FANSI_cleave, 1},
   {"order", (DL_FUNC) &FANSI_order, 1},
   {"sort_int", (DL_FUNC) &FANSI_sort_int, 1},
   {"sort_chr", (DL_FUNC) &FANSI_sort_chr, 1},
   {"set_int_max", (DL_FUNC) &FANSI_set_int_max, 1},
   {"get_int_max", (DL_FUNC) &FANSI_get_int_max, 0},
+  {"perf_counters", (DL_FUNC) &FANSI_perf_counters, 1},
   {"check_enc", (DL_FUNC) &FANSI_check_enc_ext, 2},
   {"ctl_as_int", (DL_FUNC) &FANSI_ctl_as_int_ext, 1},
   {"esc_html", (DL_FUNC) &FANSI_esc_html, 1},
+  {"api_substr", (DL_FUNC) &FANSI_api_substr_ext, 8},
+  {"term_cap_idx", (DL_FUNC) &FANSI_term_cap_idx, 1},
+  {"ctl_idx", (DL_FUNC) &FANSI_ctl_idx, 1},
+  {"substr_args", (DL_FUNC) &FANSI_substr_args, 14},
+  {"nchar_ctl", (DL_FUNC) &FANSI_nchar_ctl, 7},
+  {"strwrap_ctl", (DL_FUNC) &FANSI_strwrap_ctl, 18},
+  {"opts_make", (DL_FUNC) &FANSI_opts_make, 5},
+  {"opts_args", (DL_FUNC) &FANSI_opts_args, 1},
+  {"opts_sgr", (DL_FUNC) &FANSI_opts_sgr, 1},
   {NULL, NULL, 0}
 };
 
 SEXP FANSI_warn_sym;
+SEXP FANSI_threads_sym;
+SEXP FANSI_opts_sym;
 
 void R_init_fansi(DllInfo *info)
 {
@@ -59,7 +83,14 @@ void R_init_fansi(DllInfo *info)
   R_registerRoutines(info, NULL, callMethods, NULL, NULL);
   R_useDynamicSymbols(info, FALSE);
   R_forceSymbols(info, FALSE);
+  FANSI_api_register();
 
   FANSI_warn_sym = install("warn");
+  FANSI_threads_sym = install("fansi.threads");
+  FANSI_opts_sym = install("fansi_opts");
+}
+void R_unload_fansi(DllInfo *info) {
+  FANSI_pool_free();
+  FANSI_opts_free();
 }
 
@@ -18,6 +18,35 @@
 
 #include "fansi.h"
 
+/*
+ * Whether a string contains anything other than Control Sequences
+ *
+ * No R API use so this is safe to call from worker threads.
+ *
+ * @param warn_type set to 1 if an invalid sequence is encountered, or 2 if a
+ *   possibly incorrectly handled one is, if it is not already set.
+ */
+
+static int nzchar_chr(const char * string, int ctl_int, int * warn_type) {
+  int ctl_not_ctl = 0;
+
+  while((*string > 0 && *string < 32) || *string == 127) {
+    struct FANSI_csi_pos pos = FANSI_find_esc(string, FANSI_CTL_ALL);
+    if(!*warn_type && (!pos.valid || (pos.ctl & FANSI_CTL_ESC)))
+      *warn_type = !pos.valid ? 1 : 2;
+    string = pos.start + pos.len;
+
+    // found something not considered a control sequence, so means there is
+    // at least one character to count
+
+    ctl_not_ctl = (pos.ctl ^ ctl_int) & pos.ctl;
+    if(ctl_not_ctl) break;
+  }
+  // If string doesn't end at this point, or has ctrl sequences that are not
+  // considered control sequences, then there is at least one char
+  return *string != (0 || ctl_not_ctl);
+}
+
 SEXP FANSI_nzchar(
   SEXP x, SEXP keepNA, SEXP warn, SEXP term_cap, SEXP ctl
 ) {
@@ -34,52 +63,285 @@ SEXP FANSI_nzchar(
   int warn_int = asInteger(warn);
   int warned = 0;
   int ctl_int = FANSI_ctl_as_int(ctl);
-  int ctl_not_ctl = 0;
+  int na_res = keepNA_int == 1 ? NA_LOGICAL : 1;
 
   R_xlen_t x_len = XLENGTH(x);
 
   SEXP res = PROTECT(allocVector(LGLSXP, x_len));
+  int * res_int = LOGICAL(res);
+
+  struct FANSI_par par = FANSI_par_init(x, FANSI_threads());
+  int * warn_types = NULL;
 
+  if(par.threads > 1) {
+    warn_types = (int *) R_alloc(x_len, sizeof(int));
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+    for(int k = 0; k < par.threads; ++k) {
+      for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+        warn_types[i] = 0;
+        res_int[i] = par.chrs[i] ?
+          nzchar_chr(par.chrs[i], ctl_int, warn_types + i) : na_res;
+  } } }
   for(R_xlen_t i = 0; i < x_len; ++i) {
     FANSI_interrupt(i);
-    SEXP string_elt = STRING_ELT(x, i);
-    FANSI_check_chrsxp(string_elt, i);
+    int warn_type = 0;
+
+    if(par.threads > 1) warn_type = warn_types[i];
+    else {
+      SEXP string_elt = STRING_ELT(x, i);
+      FANSI_check_chrsxp(string_elt, i);
 
-    if(string_elt == R_NaString) {
-      if(keepNA_int == 1) {
-        LOGICAL(res)[i] = NA_LOGICAL;
-      } else LOGICAL(res)[i] = 1;
-    } else {
       // Don't bother converting to UTF8
+      if(string_elt == R_NaString) res_int[i] = na_res;
+      else res_int[i] = nzchar_chr(CHAR(string_elt), ctl_int, &warn_type);
+    }
+    if(warn_int && !warned && warn_type) {
+      warned = 1;
+      warning(
+        "Encountered %s ESC sequence at index [%jd], %s%s",
+        warn_type == 1 ? "invalid" : "possibly incorrectly handled",
+        FANSI_ind(i),
+        "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
+        "off these warnings."
+      );
+    }
+  }
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Count characters, width, or bytes in a string ignoring Control Sequences
+ *
+ * No R API use so this is safe to call from worker threads.
+ *
+ * @param type 0 for chars, 1 for width, 2 for bytes.
+ * @param wide_ok whether the string is known to be UTF-8 so that the width of
+ *   common wide characters can be looked up with `FANSI_utf8_width`.
+ * @param invalid set to 1 if an invalid or possibly incorrectly handled escape
+ *   sequence is encountered.
+ * @return the count, or -1 if the string requires `R_nchar`.
+ */
+
+static int nchar_chr(
+  const char * chr, int len, int type_int, int ctl_int, int wide_ok,
+  int * invalid
+) {
+  const char * chr_track = chr;
+  int count = 0;
+  int need_r = 0;
+
+  while(1) {
+    struct FANSI_csi_pos csi = FANSI_find_esc(chr_track, ctl_int);
+    if(!csi.valid || ((csi.ctl & FANSI_CTL_ESC) & ctl_int)) *invalid = 1;
+
+    const char * run_end = csi.len ? csi.start : chr + len;
+    int run_len = (int)(run_end - chr_track);
+
+    if(!need_r) {
+      if(type_int == 2) {
+        count += run_len;
+      } else if(type_int == 0) {
+        int run_chars = FANSI_utf8_count(chr_track, run_len);
+        if(run_chars < 0) need_r = 1;
+        else count += run_chars;
+      } else {
+        int run_width;
+        if(wide_ok) run_width = FANSI_utf8_width(chr_track, run_len);
+        else {
+          run_width = run_len;
+          for(const char * s = chr_track; s < run_end; ++s) {
+            if(*s < 0x20 || *s > 0x7E) {
+              run_width = -1;
+              break;
+        } } }
+        if(run_width < 0) need_r = 1;
+        else count += run_width;
+    } }
+    if(!csi.len) break;
+    chr_track = csi.start + csi.len;
+  }
+  return need_r ? -1 : count;
+}
+/*
+ * Strip a string into `buff` and measure it with `R_nchar`
+ *
+ * So R sees exactly what `nchar(strip_ctl(x))` would see, and thus returns NA
+ * or errors exactly as it would have.
+ */
+
+static int nchar_r(
+  SEXP x_chr, nchar_type nc_type, int allowNA_int, int keepNA_int,
+  int ctl_int, struct FANSI_buff * buff, R_xlen_t i
+) {
+  const char * chr = CHAR(x_chr);
+  const char * chr_track = chr;
+  int len = LENGTH(x_chr);
+
+  FANSI_size_buff(buff, (size_t) len + 1);
+  char * buff_track = buff->buff;
+  while(1) {
+    struct FANSI_csi_pos csi = FANSI_find_esc(chr_track, ctl_int);
+    const char * run_end = csi.len ? csi.start : chr + len;
+    memcpy(buff_track, chr_track, run_end - chr_track);
+    buff_track += run_end - chr_track;
+    if(!csi.len) break;
+    chr_track = csi.start + csi.len;
+  }
+  *buff_track = '\0';
+  FANSI_check_chr_size(buff->buff, buff_track, i);
+
+  FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+  SEXP chr_strip = PROTECT(
+    mkCharLenCE(buff->buff, buff_track - buff->buff, getCharCE(x_chr))
+  );
+  char msg_name[48];
+  snprintf(msg_name, sizeof(msg_name), "element %jd", FANSI_ind(i));
+  int res = R_nchar(chr_strip, nc_type, allowNA_int, keepNA_int, msg_name);
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Count characters, display width, or bytes, ignoring Control Sequences
+ *
+ * This is equivalent to `nchar(strip_ctl(x, ctl), type)`, except that we do
+ * not materialize the stripped character vector.  We walk each element
+ * jumping from Control Sequence to Control Sequence with `FANSI_find_esc`,
+ * counting the text in between.
+ *
+ * Byte counts are just run lengths.  Character counts are computed directly
+ * for valid UTF-8, and widths for runs of printable ASCII and of the common
+ * CJK wide characters (see `FANSI_utf8_width`).  Anything else (emoji, zero
+ * width or ambiguous width characters, C0 controls that are not being treated
+ * as Control Sequences, invalid encodings) requires `R_nchar` so we fall back
+ * to copying the stripped element into a buffer and letting R handle it.
+ *
+ * With multiple threads, elements that require `R_nchar` are left for the
+ * main thread.
+ *
+ * @param type 0 for chars, 1 for width, 2 for bytes.
+ * @param warn whether to warn about invalid or possibly incorrectly handled
+ *   escape sequences; as with `FANSI_strip` we only warn once for the first
+ *   such element.
+ */
+
+SEXP FANSI_nchar(
+  SEXP x, SEXP type, SEXP allowNA, SEXP keepNA, SEXP warn, SEXP term_cap,
+  SEXP ctl
+) {
+  if(
+    TYPEOF(x) != STRSXP ||
+    TYPEOF(type) != INTSXP || XLENGTH(type) != 1 ||
+    TYPEOF(allowNA) != LGLSXP || XLENGTH(allowNA) != 1 ||
+    TYPEOF(keepNA) != LGLSXP || XLENGTH(keepNA) != 1 ||
+    TYPEOF(warn) != LGLSXP || XLENGTH(warn) != 1 ||
+    TYPEOF(term_cap) != INTSXP ||
+    TYPEOF(ctl) != INTSXP
+  )
+    error("Internal error: input type error; contact maintainer"); // nocov
+
+  return FANSI_nchar_int(
+    x, asInteger(type), asLogical(allowNA), asLogical(keepNA), asLogical(warn),
+    FANSI_ctl_as_int(ctl)
+  );
+}
+/*
+ * As `FANSI_nchar`, with the settings already resolved
+ *
+ * @param type 0 for chars, 1 for width, 2 for bytes.
+ * @param ctl the `ctl` bit mask.
+ */
+SEXP FANSI_nchar_int(
+  SEXP x, int type_int, int allowNA_int, int keepNA_int, int warn_int,
+  int ctl_int
+) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal error: input type error; contact maintainer"); // nocov
+  if(type_int < 0 || type_int > 2)
+    error("Internal Error: invalid `type` value; contact maintainer"); // nocov
+
+  nchar_type nc_type = type_int == 0 ? Chars : (type_int == 1 ? Width : Bytes);
+
+  // Mirror `nchar`: with keepNA = NA, NA is 2 for width, NA otherwise
+
+  int na_res = keepNA_int == 1 || (keepNA_int == NA_LOGICAL && type_int != 1) ?
+    NA_INTEGER : 2;
+
+  R_xlen_t x_len = XLENGTH(x);
+  SEXP res = PROTECT(allocVector(INTSXP, x_len));
+  int * res_int = INTEGER(res);
+
+  int invalid_ansi = 0;
+  R_xlen_t invalid_idx = 0;
+  struct FANSI_buff buff = {.buff=NULL, .len=0};
+
+  // Inputs are converted to UTF-8 by the R code, except "bytes" strings
+  // whose widths must be left to `R_nchar`.
+
+  int wide_ok = type_int == 1;
+  for(R_xlen_t i = 0; i < x_len && wide_ok; ++i)
+    wide_ok = getCharCE(STRING_ELT(x, i)) != CE_BYTES;
+
+  struct FANSI_par par = FANSI_par_init(x, FANSI_threads());
+  int * invalid = NULL;
+
+  if(par.threads > 1) {
+    invalid = (int *) R_alloc(x_len, sizeof(int));
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+    for(int k = 0; k < par.threads; ++k) {
+      for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+        invalid[i] = 0;
+        res_int[i] = par.chrs[i] ?
+          nchar_chr(
+            par.chrs[i], par.lens[i], type_int, ctl_int, wide_ok, invalid + i
+          ) : na_res;
+  } } }
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP x_chr = STRING_ELT(x, i);
+    int invalid_i = 0;
+
+    if(par.threads > 1) {
+      invalid_i = invalid[i];
+    } else if(x_chr == NA_STRING) {
+      res_int[i] = na_res;
+    } else {
+      FANSI_check_chrsxp(x_chr, i);
+      res_int[i] = nchar_chr(
+        CHAR(x_chr), LENGTH(x_chr), type_int, ctl_int, wide_ok, &invalid_i
+      );
+    }
+    if(!invalid_ansi && invalid_i) {
+      invalid_ansi = 1;
+      invalid_idx = i;
+    }
+    if(res_int[i] == -1)
+      res_int[i] = nchar_r(
+        x_chr, nc_type, allowNA_int, keepNA_int, ctl_int, &buff, i
+      );
+  }
+  if(invalid_ansi && warn_int) {
+    warning(
+      "Encountered %s index [%jd], %s%s",
+      "invalid or possibly incorrectly handled ESC sequence at",
+      FANSI_ind(invalid_idx),
+      "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
+      "off these warnings."
+    );
+  }
+  // Same attributes `nchar` keeps
+
+  SEXP dim, dimnames, names;
+  if((dim = getAttrib(x, R_DimSymbol)) != R_NilValue)
+    setAttrib(res, R_DimSymbol, dim);
+  if((dimnames = getAttrib(x, R_DimNamesSymbol)) != R_NilValue)
+    setAttrib(res, R_DimNamesSymbol, dimnames);
+  if((names = getAttrib(x, R_NamesSymbol)) != R_NilValue)
+    setAttrib(res, R_NamesSymbol, names);
 
-      const char * string = CHAR(string_elt);
-
-      while((*string > 0 && *string < 32) || *string == 127) {
-        struct FANSI_csi_pos pos = FANSI_find_esc(string, FANSI_CTL_ALL);
-        if(
-          warn_int && !warned && (!pos.valid || (pos.ctl & FANSI_CTL_ESC))
-        ) {
-          warned = 1;
-          warning(
-            "Encountered %s ESC sequence at index [%jd], %s%s",
-            !pos.valid ? "invalid" : "possibly incorrectly handled",
-            FANSI_ind(i),
-            "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
-            "off these warnings."
-          );
-        }
-        string = pos.start + pos.len;
-
-        // found something not considered a control sequence, so means there is
-        // at least one character to count
-
-        ctl_not_ctl = (pos.ctl ^ ctl_int) & pos.ctl;
-        if(ctl_not_ctl) break;
-      }
-      // If string doesn't end at this point, or has ctrl sequences that are not
-      // considered control sequences, then there is at least one char
-      LOGICAL(res)[i] = *string != (0 || ctl_not_ctl);
-  } }
   UNPROTECT(1);
   return res;
 }
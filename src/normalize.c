@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Rewrite SGR sequences as minimal deltas
+ *
+ * SGR sequences are dropped from the input as they are read, and the net
+ * change in state is written as a single sequence right before the next
+ * character or non-SGR escape sequence (this includes C0 controls such as
+ * newlines).  Non-SGR escape sequences are copied as is.
+ *
+ * Escape sequences that we do not fully understand (e.g. SGR with unknown
+ * tokens, or malformed sequences) are copied as is, after writing out the
+ * pending state change, as we cannot know how they should be rewritten.
+ */
+
+/*
+ * Transformations applied to the state of each character
+ *
+ * - cap: if not negative, the terminal capabilities to downgrade colors to,
+ *   see FANSI_TERM_*.
+ * - filter: whether to only keep the attributes in the remaining fields, which
+ *   are bit masks for the corresponding `FANSI_state` fields, or for `color`,
+ *   `bg_color` and `font` flags.
+ */
+struct norm_opts {
+  int cap;
+  int filter;
+  unsigned int style;
+  unsigned int border;
+  unsigned int ideogram;
+  int color;
+  int bg_color;
+  int font;
+};
+/*
+ * Apply `opts` to a state, recording whether anything changed in `changed`
+ */
+static struct FANSI_state norm_want(
+  struct FANSI_state state, const struct norm_opts * opts, int * changed
+) {
+  if(opts->cap < 0 && !opts->filter) return state;
+  struct FANSI_state res = state;
+  if(opts->cap >= 0) res = FANSI_state_downgrade(res, opts->cap);
+  if(opts->filter) {
+    res.style &= opts->style;
+    res.border &= opts->border;
+    res.ideogram &= opts->ideogram;
+    if(!opts->font) res.font = 0;
+    if(!opts->color) {
+      res.color = -1;
+      for(int i = 0; i < 4; ++i) res.color_extra[i] = 0;
+    }
+    if(!opts->bg_color) {
+      res.bg_color = -1;
+      for(int i = 0; i < 4; ++i) res.bg_color_extra[i] = 0;
+    }
+  }
+  if(FANSI_state_comp(res, state)) *changed = 1;
+  return res;
+}
+/*
+ * Copy the non-SGR sequences of a contiguous run of escape sequences
+ *
+ * Non-SGR sequences may depend on the SGR state (e.g. erasing a line uses the
+ * background color), so any pending state change is written before them.
+ *
+ * @param state the state ahead of the run.
+ * @param term the state the output has set so far, updated by reference.
+ * @param scratch used to NULL terminate the run and the SGR sequences in it so
+ *   that `FANSI_find_esc` and `FANSI_read_next` don't read past them.
+ * @return the number of bytes written.
+ */
+static size_t norm_copy_esc(
+  struct FANSI_state state, int bytes, char * buff,
+  struct FANSI_state * term, struct FANSI_buff * scratch,
+  const struct norm_opts * opts, int * changed
+) {
+  // Common case is that the whole run is SGR
+
+  const char * esc = state.string + state.pos_byte;
+  struct FANSI_csi_pos csi = FANSI_find_esc(esc, FANSI_CTL_SGR);
+  if(csi.start == esc && csi.len == bytes) return 0;
+
+  FANSI_size_buff(scratch, (size_t) bytes + 1);
+  char * track = scratch->buff;
+  char * end = scratch->buff + bytes;
+  memcpy(track, esc, bytes);
+  *end = 0;
+
+  struct FANSI_state cur = FANSI_reset_pos(state);
+  cur.warn = 0;
+  size_t size = 0;
+
+  while(track < end) {
+    csi = FANSI_find_esc(track, FANSI_CTL_SGR);
+    char * keep_end = csi.len ? (char *) csi.start : end;
+    if(keep_end > track) {
+      struct FANSI_state want = norm_want(cur, opts, changed);
+      size += FANSI_csi_delta_write(buff ? buff + size : NULL, *term, want, 0);
+      *term = FANSI_state_copy_style(*term, want);
+      if(buff) memcpy(buff + size, track, keep_end - track);
+      size += keep_end - track;
+    }
+    if(!csi.len) break;
+
+    // Apply the SGR sequences to the state
+
+    track = keep_end + csi.len;
+    char track_chr = *track;
+    *track = 0;
+    cur.string = keep_end;
+    cur.pos_byte = 0;
+    cur = FANSI_read_next(cur);
+    *track = track_chr;
+  }
+  return size;
+}
+/*
+ * Compute the size of, or write, the normalized element
+ *
+ * @param buff where to write, or NULL to only compute the size.  Does not
+ *   write the NULL terminator.
+ * @param opts transformations to apply, see `norm_opts`.
+ * @param changed set to 1 if `opts` changed the state of any character.
+ * @param state_end set to the state at the end of the element.
+ * @return the size of the normalized string.
+ */
+static int norm_walk(
+  struct FANSI_state state, char * buff, struct FANSI_buff * scratch,
+  const struct norm_opts * opts, int * changed, struct FANSI_state * state_end
+) {
+  struct FANSI_state term = state;
+  size_t size = 0;
+
+  while(state.string[state.pos_byte]) {
+    struct FANSI_state next = FANSI_read_next(state);
+    const char * chr = state.string + state.pos_byte;
+    int bytes = next.pos_byte - state.pos_byte;
+    int err = next.err_code;
+
+    if(*chr == 0x1b && (!err || err == 4 || err == 6)) {
+      // Escapes we understand; SGR changes are deferred
+
+      size += norm_copy_esc(
+        state, bytes, buff ? buff + size : NULL, &term, scratch, opts, changed
+      );
+    } else {
+      struct FANSI_state want = norm_want(state, opts, changed);
+      size += FANSI_csi_delta_write(buff ? buff + size : NULL, term, want, 0);
+      if(buff) memcpy(buff + size, chr, bytes);
+      size += bytes;
+      term = *chr == 0x1b ? next : want;
+    }
+    if(size > (size_t) FANSI_int_max)
+      error(
+        "%s%s",
+        "Attempting to create string longer than INT_MAX while normalizing ",
+        "CSI SGR sequences."
+      );
+    state = next;
+  }
+  int delta = FANSI_csi_delta_write(
+    buff ? buff + size : NULL, term, norm_want(state, opts, changed), 0
+  );
+  if(size > (size_t) (FANSI_int_max - delta))
+    error(
+      "%s%s",
+      "Attempting to create string longer than INT_MAX while normalizing ",
+      "CSI SGR sequences."
+    );
+  *state_end = state;
+  return (int) size + delta;
+}
+/*
+ * @param x a character vector, already in UTF-8
+ * @param opts see `norm_opts`; when transforming elements, those that `opts`
+ *   does not change are returned as is.
+ */
+static SEXP norm_vec(
+  SEXP x, SEXP warn, SEXP term_cap, const struct norm_opts * opts
+) {
+  int transform = opts->cap >= 0 || opts->filter;
+  R_xlen_t x_len = XLENGTH(x);
+  int warned = 0;
+
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+  struct FANSI_buff scratch = {.len = 0};
+
+  struct FANSI_state state_blank = FANSI_state_init("", warn, term_cap);
+  if(opts->cap >= 0)
+    state_blank.term_cap =
+      FANSI_TERM_BRIGHT | FANSI_TERM_256 | FANSI_TERM_TRUECOLOR;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    SET_STRING_ELT(res, i, chr);
+    if(chr == NA_STRING) continue;
+    FANSI_check_chrsxp(chr, i);
+
+    const char * string = CHAR(chr);
+    if(!memchr(string, 0x1b, LENGTH(chr))) continue;
+
+    struct FANSI_state state = state_blank;
+    state.string = string;
+    if(warned) state.warn = -state.warn;
+
+    // Measure, then write
+
+    struct FANSI_state state_end;
+    int changed = 0;
+    int size = norm_walk(state, NULL, &scratch, opts, &changed, &state_end);
+    warned = warned || state_end.warn < 0;
+    if(transform && !changed) continue;
+
+    FANSI_size_buff(&buff, (size_t) size + 1);
+    state.warn = 0;
+    norm_walk(state, buff.buff, &scratch, opts, &changed, &state_end);
+    buff.buff[size] = 0;
+
+    if(size != LENGTH(chr) || memcmp(buff.buff, string, size)) {
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+      SET_STRING_ELT(res, i, mkCharLenCE(buff.buff, size, getCharCE(chr)));
+    }
+  }
+  UNPROTECT(1);
+  return res;
+}
+SEXP FANSI_normalize(SEXP x, SEXP warn, SEXP term_cap) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  struct norm_opts opts = {.cap = -1};
+  return norm_vec(x, warn, term_cap, &opts);
+}
+/*
+ * Rewrite colors the terminal does not support as the nearest ones it does
+ *
+ * This reuses the normalization machinery, so SGR sequences of elements that
+ * have colors to downgrade are also normalized.  Sequences are read as if the
+ * terminal supported all colors.
+ *
+ * @param term_cap the capabilities of the target terminal.
+ */
+SEXP FANSI_downgrade(SEXP x, SEXP warn, SEXP term_cap) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  struct norm_opts opts = {
+    .cap = FANSI_state_init("", warn, term_cap).term_cap
+  };
+  return norm_vec(x, warn, term_cap, &opts);
+}
+/*
+ * Drop SGR attributes other than those in `keep`
+ *
+ * @param keep integer vector of 1-based indices into the R level
+ *   `VALID.SGR.ATTR` constant, where 1 ("all") inverts the selection.
+ */
+SEXP FANSI_filter_sgr(SEXP x, SEXP keep, SEXP warn, SEXP term_cap) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(keep) != INTSXP ||
+    TYPEOF(warn) != LGLSXP || TYPEOF(term_cap) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  // Style bits for each of the style values in `VALID.SGR.ATTR`, with both
+  // blink speeds under one value
+
+  static const unsigned int style_bits[] = {
+    1U << 1, 1U << 2, 1U << 3, 1U << 4, 1U << 5 | 1U << 6, 1U << 7, 1U << 8,
+    1U << 9, 1U << 10, 1U << 11, 1U << 12
+  };
+  int style_n = (int) (sizeof(style_bits) / sizeof(unsigned int));
+  int attr_n = style_n + 5;  // color, bg-color, border, ideogram, font
+  unsigned int keep_int = 0;
+  int flip_bits = 0;
+
+  for(R_xlen_t i = 0; i < XLENGTH(keep); ++i) {
+    int val = INTEGER(keep)[i] - 2;
+    if(val < -1 || val >= attr_n)
+      error("Internal Error: bad `keep` value; contact maintainer."); // nocov
+    if(val < 0) flip_bits = 1;
+    else keep_int |= 1U << val;
+  }
+  if(flip_bits) keep_int ^= (1U << attr_n) - 1U;
+
+  struct norm_opts opts = {.cap = -1, .filter = 1};
+  for(int i = 0; i < style_n; ++i)
+    if(keep_int & (1U << i)) opts.style |= style_bits[i];
+  opts.color = (keep_int & (1U << style_n)) > 0;
+  opts.bg_color = (keep_int & (1U << (style_n + 1))) > 0;
+  if(keep_int & (1U << (style_n + 2))) opts.border = ~0U;
+  if(keep_int & (1U << (style_n + 3))) opts.ideogram = ~0U;
+  opts.font = (keep_int & (1U << (style_n + 4))) > 0;
+
+  return norm_vec(x, warn, term_cap, &opts);
+}
+/*
+ * Compute the sequences that close the SGR state of each element
+ *
+ * Each active attribute is turned off with its own code (e.g. 39 for the
+ * foreground color) instead of with a reset.
+ *
+ * @param x a character vector of SGR sequences, e.g. as produced by
+ *   `FANSI_csi_write`.
+ */
+SEXP FANSI_sgr_close(SEXP x, SEXP term_cap) {
+  if(TYPEOF(x) != STRSXP || TYPEOF(term_cap) != INTSXP)
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  SEXP R_false = PROTECT(ScalarLogical(0));
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  struct FANSI_sgr sgr_blank = {.color=-1, .bg_color=-1};
+  char buff[256];
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) {
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    struct FANSI_state state = FANSI_read_esc_all(
+      FANSI_state_init(CHAR(chr), R_false, term_cap), NULL, i
+    );
+    int size = FANSI_csi_delta_write(
+      buff, state, FANSI_sgr_to_state(sgr_blank, state), 1
+    );
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SET_STRING_ELT(res, i, mkCharLenCE(buff, size, CE_NATIVE));
+  }
+  UNPROTECT(2);
+  return res;
+}
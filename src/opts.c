@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Validated, cached versions of the `term.cap` and `ctl` arguments
+ *
+ * The exported functions are often called many times on tiny inputs with
+ * the same `term.cap` (usually `getOption('fansi.term.cap')`) and `ctl`
+ * (usually the "all" default) values, so validating and `match`ing them in R
+ * every time is most of the cost of each call.  Instead we remember the last
+ * few values seen for each and the corresponding 1 based index vectors into
+ * VALID.TERM.CAP / VALID.CTL.  More than one slot is kept so that callers
+ * that alternate between values (e.g. `ctl="all"` and `ctl="sgr"`) do not
+ * rebuild the entries on every call.  Slots are kept in most recently used
+ * order and the least recently used one is evicted on a miss.
+ *
+ * The cache is keyed on the CHARSXPs of the input rather than on the input
+ * SEXP itself as the latter could have been modified in place since we last
+ * saw it.  Since CHARSXPs are cached by R, pointer equality is the same as
+ * string equality, so a hit costs a few pointer comparisons.
+ *
+ * Keep the choices in sync with R/constants.R.
+ */
+
+static const char * term_cap_valid[] = {"bright", "256", "truecolor"};
+static const char * ctl_valid[] = {"all", "nl", "c0", "sgr", "csi", "esc"};
+
+#define OPTS_CACHE_SLOTS 4
+
+struct opts_cache {
+  SEXP key;   // copy of the input, preserved
+  SEXP val;   // the corresponding index vector, preserved
+};
+static struct opts_cache term_cap_cache[OPTS_CACHE_SLOTS];
+static struct opts_cache ctl_cache[OPTS_CACHE_SLOTS];
+
+static int cache_hit(struct opts_cache * cache, SEXP x) {
+  if(!cache->key || XLENGTH(cache->key) != XLENGTH(x)) return 0;
+  for(R_xlen_t i = 0; i < XLENGTH(x); ++i)
+    if(STRING_ELT(x, i) != STRING_ELT(cache->key, i)) return 0;
+  return 1;
+}
+// Move slot `i` to the front, shifting the more recent ones back by one.
+
+static void cache_promote(struct opts_cache * cache, int i) {
+  struct opts_cache tmp = cache[i];
+  for(; i > 0; --i) cache[i] = cache[i - 1];
+  cache[0] = tmp;
+}
+static SEXP as_idx(
+  SEXP x, struct opts_cache * cache, const char ** valid, int valid_n,
+  const char * err_type, const char * err_val
+) {
+  if(TYPEOF(x) != STRSXP) error("%s", err_type);
+  for(int i = 0; i < OPTS_CACHE_SLOTS; ++i) {
+    if(cache_hit(cache + i, x)) {
+      cache_promote(cache, i);
+      return cache[0].val;
+  } }
+  R_xlen_t x_len = XLENGTH(x);
+  SEXP val = PROTECT(allocVector(INTSXP, x_len));
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    SEXP chr = STRING_ELT(x, i);
+    int idx = 0;
+    if(chr != NA_STRING) {
+      for(int j = 0; j < valid_n && !idx; ++j)
+        if(!strcmp(CHAR(chr), valid[j])) idx = j + 1;
+    }
+    if(!idx) error("%s", err_val);
+    INTEGER(val)[i] = idx;
+  }
+  // R code must not be able to modify the cached value in place
+  MARK_NOT_MUTABLE(val);
+  SEXP key = PROTECT(duplicate(x));
+  R_PreserveObject(key);
+  R_PreserveObject(val);
+
+  // Evict the least recently used slot and make the new entry the most recent
+
+  struct opts_cache * last = cache + OPTS_CACHE_SLOTS - 1;
+  if(last->key) {
+    R_ReleaseObject(last->key);
+    R_ReleaseObject(last->val);
+  }
+  last->key = key;
+  last->val = val;
+  cache_promote(cache, OPTS_CACHE_SLOTS - 1);
+  UNPROTECT(2);
+  return val;
+}
+/*
+ * Equivalent to `match(term.cap, VALID.TERM.CAP)` with the validation that
+ * the exported functions do.
+ *
+ * @return an integer vector that must not be modified.
+ */
+SEXP FANSI_term_cap_idx(SEXP term_cap) {
+  return as_idx(
+    term_cap, term_cap_cache, term_cap_valid, 3,
+    "Argument `term.cap` must be character.",
+    "Argument `term.cap` may only contain values in "
+    "c(\"bright\", \"256\", \"truecolor\")"
+  );
+}
+/*
+ * Equivalent to `match(ctl, VALID.CTL)` with the validation that the exported
+ * functions do.
+ *
+ * @return an integer vector that must not be modified.
+ */
+SEXP FANSI_ctl_idx(SEXP ctl) {
+  return as_idx(
+    ctl, ctl_cache, ctl_valid, 6,
+    "Argument `ctl` must be character.",
+    "Argument `ctl` may contain only values in "
+    "`c(\"all\", \"nl\", \"c0\", \"sgr\", \"csi\", \"esc\")`"
+  );
+}
+/*
+ * Release the cached values, for use when the package is unloaded.
+ */
+void FANSI_opts_free() {
+  struct opts_cache * caches[] = {term_cap_cache, ctl_cache};
+  for(int i = 0; i < 2; ++i) {
+    for(int j = 0; j < OPTS_CACHE_SLOTS; ++j) {
+      struct opts_cache * slot = caches[i] + j;
+      if(slot->key) {
+        R_ReleaseObject(slot->key);
+        R_ReleaseObject(slot->val);
+        slot->key = slot->val = NULL;
+  } } }
+}
+/*
+ * `fansi_opts` objects
+ *
+ * An external pointer tagged with `FANSI_opts_sym` and with class
+ * "fansi_opts", pointing at a `struct FANSI_opts` with the resolved settings.
+ * The protected value is a list with:
+ *
+ * 0. The settings as the validated R values the .Call entry points take (see
+ *    `FANSI_opts_args`), so the R wrappers can pass them on as is.
+ * 1. A RAWSXP holding the `struct FANSI_opts` the pointer points to.
+ * 2. NULL, or the `ctl="sgr"` version of the object (see `FANSI_opts_sgr`).
+ *
+ * Since the object can't be modified from R the settings are only ever
+ * validated once.  The address is not kept when the object is serialized, so
+ * a saved and re-loaded object is rejected instead.
+ */
+static const char * opts_names[] = {
+  "warn", "term.cap", "term.cap.int", "ctl", "ctl.int", "tabs.as.spaces",
+  "tab.stops"
+};
+static SEXP opts_new(struct FANSI_opts opts, SEXP args) {
+  SEXP prot = PROTECT(allocVector(VECSXP, 3));
+  SEXP raw = PROTECT(allocVector(RAWSXP, sizeof(struct FANSI_opts)));
+  memcpy(RAW(raw), &opts, sizeof(struct FANSI_opts));
+  MARK_NOT_MUTABLE(args);
+  SET_VECTOR_ELT(prot, 0, args);
+  SET_VECTOR_ELT(prot, 1, raw);
+
+  SEXP res = PROTECT(R_MakeExternalPtr(RAW(raw), FANSI_opts_sym, prot));
+  setAttrib(res, R_ClassSymbol, PROTECT(mkString("fansi_opts")));
+  UNPROTECT(4);
+  return res;
+}
+/*
+ * Validate the `fansi_opts` arguments and create the object
+ */
+SEXP FANSI_opts_make(
+  SEXP warn, SEXP term_cap, SEXP ctl, SEXP tabs_as_spaces, SEXP tab_stops
+) {
+  const char * lgl = "TRUE or FALSE";
+  int warn_int = FANSI_arg_flag(warn, "warn", lgl);
+  int tabs_int = FANSI_arg_flag(tabs_as_spaces, "tabs.as.spaces", lgl);
+  SEXP tab_stops_int = PROTECT(FANSI_arg_tab_stops(tab_stops));
+  SEXP term_cap_idx = PROTECT(FANSI_term_cap_idx(term_cap));
+  SEXP ctl_idx = PROTECT(FANSI_ctl_idx(ctl));
+  SEXP warn_sxp = PROTECT(ScalarLogical(warn_int));
+
+  struct FANSI_opts opts = FANSI_opts_sxp(warn_sxp, term_cap_idx, ctl_idx);
+  opts.tabs_as_spaces = tabs_int;
+
+  SEXP args = PROTECT(allocVector(VECSXP, 7));
+  SEXP names = PROTECT(allocVector(STRSXP, 7));
+  for(int i = 0; i < 7; ++i) SET_STRING_ELT(names, i, mkChar(opts_names[i]));
+  setAttrib(args, R_NamesSymbol, names);
+  SET_VECTOR_ELT(args, 0, warn_sxp);
+  SET_VECTOR_ELT(args, 1, duplicate(term_cap));
+  SET_VECTOR_ELT(args, 2, term_cap_idx);
+  SET_VECTOR_ELT(args, 3, duplicate(ctl));
+  SET_VECTOR_ELT(args, 4, ctl_idx);
+  SET_VECTOR_ELT(args, 5, ScalarLogical(tabs_int));
+  SET_VECTOR_ELT(args, 6, tab_stops_int);
+
+  SEXP res = opts_new(opts, args);
+  UNPROTECT(6);
+  return res;
+}
+static SEXP opts_check(SEXP opts) {
+  if(
+    TYPEOF(opts) != EXTPTRSXP || R_ExternalPtrTag(opts) != FANSI_opts_sym ||
+    !inherits(opts, "fansi_opts")
+  )
+    error("Argument `opts` must be NULL or created with `fansi_opts`.");
+  if(!R_ExternalPtrAddr(opts))
+    error(
+      "%s%s",
+      "Argument `opts` is no longer valid, e.g. because it was saved and ",
+      "re-loaded; re-create it with `fansi_opts`."
+    );
+  return R_ExternalPtrProtected(opts);
+}
+/*
+ * The settings of a `fansi_opts` object, for C entry points that can use them
+ * directly instead of resolving the individual arguments.
+ */
+struct FANSI_opts FANSI_opts_get(SEXP opts) {
+  opts_check(opts);
+  return *(struct FANSI_opts *) R_ExternalPtrAddr(opts);
+}
+/*
+ * The settings of a `fansi_opts` object as the validated R values, named as
+ * the `fansi_opts` parameters with `term.cap.int` and `ctl.int` the 1 based
+ * indices into VALID.TERM.CAP and VALID.CTL.
+ *
+ * @return a list that must not be modified.
+ */
+SEXP FANSI_opts_args(SEXP opts) {
+  return VECTOR_ELT(opts_check(opts), 0);
+}
+/*
+ * `opts` with `ctl="sgr"`, for the `_sgr` functions.  The result is stored
+ * in `opts` so it is only created once.
+ */
+SEXP FANSI_opts_sgr(SEXP opts) {
+  if(opts == R_NilValue) return opts;
+  SEXP prot = opts_check(opts);
+  struct FANSI_opts opts_int = FANSI_opts_get(opts);
+  if(opts_int.ctl == FANSI_CTL_SGR) return opts;
+
+  SEXP res = VECTOR_ELT(prot, 2);
+  if(res == R_NilValue) {
+    SEXP ctl = PROTECT(mkString("sgr"));
+    SEXP args = PROTECT(shallow_duplicate(VECTOR_ELT(prot, 0)));
+    SET_VECTOR_ELT(args, 3, ctl);
+    SET_VECTOR_ELT(args, 4, FANSI_ctl_idx(ctl));
+    opts_int.ctl = FANSI_CTL_SGR;
+    res = opts_new(opts_int, args);
+    SET_VECTOR_ELT(prot, 2, res);
+    UNPROTECT(2);
+  }
+  return res;
+}
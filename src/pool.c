@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Session persistent scratch buffers
+ *
+ * `FANSI_size_buff` normally uses `R_alloc`, so every call starts from an
+ * empty buffer, and every time a buffer grows the old block stays allocated
+ * until the `.Call` returns.  Buffers attached to a pool slot are instead
+ * `malloc`ed and kept across calls, so that e.g. millions of calls on short
+ * strings re-use the same memory.
+ *
+ * Only the main thread touches the pool.  A slot is busy from the time it is
+ * attached to a `FANSI_buff` until it is released, and slots are always
+ * released via `FANSI_with_buff`, which uses `R_ExecWithCleanup` so that this
+ * also happens if there is an error or an interrupt.  If all slots are busy
+ * (e.g. fansi called from a warning handler called from fansi) the buffer
+ * just falls back to `R_alloc`.
+ *
+ * Buffers are freed when the package is unloaded, when they are larger than
+ * FANSI_POOL_MAX on release, or when they have been much larger than needed
+ * for FANSI_POOL_IDLE releases in a row.
+ */
+
+#define FANSI_POOL_N 8
+#define FANSI_POOL_MAX ((size_t) 1 << 24)
+#define FANSI_POOL_MIN ((size_t) 4096)  // never shrink below this
+#define FANSI_POOL_IDLE 64
+
+struct pool_slot {
+  char * buff;
+  size_t len;
+  size_t peak;   // largest size requested since the slot was attached
+  int idle;      // consecutive releases with `peak` much smaller than `len`
+  int busy;
+};
+static struct pool_slot pool[FANSI_POOL_N];
+
+static void slot_free(struct pool_slot * slot) {
+  free(slot->buff);
+  slot->buff = NULL;
+  slot->len = slot->peak = 0;
+  slot->idle = 0;
+}
+/*
+ * Attach a free pool slot to `buff`, which must not have been sized yet.
+ */
+void FANSI_buff_pool(struct FANSI_buff * buff) {
+  if(buff->len || buff->pool)
+    error("Internal Error: can only pool fresh buffers.");  // nocov
+
+  for(int i = 0; i < FANSI_POOL_N; ++i) {
+    if(!pool[i].busy) {
+      pool[i].busy = 1;
+      pool[i].peak = 0;
+      buff->pool = i + 1;
+      buff->buff = pool[i].buff;
+      buff->len = pool[i].len;
+      break;
+    }
+  }
+}
+/*
+ * Return the slot attached to `buff` (if any) to the pool.
+ */
+void FANSI_buff_release(struct FANSI_buff * buff) {
+  if(!buff->pool) return;
+  struct pool_slot * slot = pool + buff->pool - 1;
+
+  if(slot->len > FANSI_POOL_MIN && slot->peak <= slot->len / 4)
+    ++slot->idle;
+  else slot->idle = 0;
+
+  if(slot->len > FANSI_POOL_MAX || slot->idle >= FANSI_POOL_IDLE)
+    slot_free(slot);
+
+  slot->busy = 0;
+  buff->pool = 0;
+  buff->buff = NULL;
+  buff->len = 0;
+}
+/*
+ * Called by `FANSI_size_buff` for pooled buffers.
+ *
+ * Records the requested `size`, and if `buff->len` was grown by the caller
+ * replaces the slot memory with a block of that size.  Contents are not
+ * preserved, same as with `R_alloc` buffers.
+ */
+void FANSI_pool_size(struct FANSI_buff * buff, size_t size) {
+  struct pool_slot * slot = pool + buff->pool - 1;
+  if(size > slot->peak) slot->peak = size;
+
+  if(buff->len > slot->len) {
+    free(slot->buff);
+    slot->buff = malloc(buff->len);
+    if(!slot->buff) {
+      size_t len = buff->len;
+      slot->len = buff->len = 0;
+      buff->buff = NULL;
+      error("Unable to allocate buffer of size %zu.", len);
+    }
+    slot->len = buff->len;
+    buff->buff = slot->buff;
+  }
+}
+static void buff_cleanup(void * buff) {
+  FANSI_buff_release((struct FANSI_buff *) buff);
+}
+/*
+ * Run `fun(data)` with `buff` attached to the pool for the duration.
+ *
+ * `buff` will normally be part of `data` so `fun` can use it.
+ */
+SEXP FANSI_with_buff(
+  SEXP (*fun)(void *), void * data, struct FANSI_buff * buff
+) {
+  FANSI_buff_pool(buff);
+  return R_ExecWithCleanup(fun, data, buff_cleanup, buff);
+}
+/*
+ * Free all the pool memory, for use when the package is unloaded.
+ */
+void FANSI_pool_free() {
+  for(int i = 0; i < FANSI_POOL_N; ++i) {
+    slot_free(pool + i);
+    pool[i].busy = 0;
+  }
+}
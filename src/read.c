@@ -24,16 +24,10 @@ static int is_num(const char * string) {
   return *string >= 48 && *string <= 57;
 }
 // Convert a char value to number by subtracting the zero char; only intended
-// for use with string values in [0-9]
+// for use with string values in [0-9], -1 otherwise
 
 static int as_num(const char * string) {
-  if(!is_num(string))
-    // nocov start
-    error(
-      "Internal Error: attempt to convert non-numeric char (%d) to int.",
-      (int) *string
-    );
-    // nocov end
+  if(!is_num(string)) return -1;  // nocov
   return (int) (*string - '0');
 }
 /*
@@ -132,7 +126,12 @@ struct FANSI_tok_res FANSI_parse_token(const char * string) {
   if(!err_code) {
     int len2 = len - leading_zeros;
     while(len2--) {
-      val += (as_num(--string) * mult);
+      int num = as_num(--string);
+      if(num < 0) {
+        err_code = FANSI_ERR_FATAL; // nocov
+        break;                      // nocov
+      }
+      val += (num * mult);
       mult *= 10;
   } }
   if(err_code < 3 && val > 255) err_code = 1;
@@ -163,8 +162,10 @@ struct FANSI_tok_res FANSI_parse_token(const char * string) {
 static struct FANSI_state parse_colors(
   struct FANSI_state state, int mode
 ) {
-  if(mode != 3 && mode != 4)
-    error("Internal Error: parsing color with invalid mode.");  // nocov
+  if(mode != 3 && mode != 4) {
+    state.err_code = FANSI_ERR_FATAL;  // nocov
+    return state;                      // nocov
+  }
 
   struct FANSI_tok_res res;
   int rgb[4] = {0};
@@ -203,7 +204,10 @@ static struct FANSI_state parse_colors(
         i_max = 3;
       } else if (colors == 5) {
         i_max = 1;
-      } else error("Internal Error: 1301341"); // nocov
+      } else {
+        state.err_code = FANSI_ERR_FATAL;  // nocov
+        return state;                      // nocov
+      }
 
       rgb[0] = colors;
 
@@ -221,12 +225,8 @@ static struct FANSI_state parse_colors(
           if(res.val < 256 && !early_end) {
             rgb[i + 1] = res.val;
           } else {
-            // nocov start
-            error(
-              "Internal Error: invalid color without err_code; ",
-              "contact maintainer."
-            );
-            // nocov end
+            state.err_code = FANSI_ERR_FATAL;  // nocov
+            break;                             // nocov
           }
         } else break;
       }
@@ -313,14 +313,13 @@ static struct FANSI_state read_esc(struct FANSI_state state) {
   /***************************************************\
   | IMPORTANT: KEEP THIS ALIGNED WITH FANSI_find_esc  |
   \***************************************************/
-  if(state.string[state.pos_byte] != 27)
+  if(state.string[state.pos_byte] != 27) {
     // nocov start
-    error(
-      "Internal error: %s (decimal char %d).",
-      "parsing ESC sequence that doesn't start with ESC",
-      (int) state.string[state.pos_byte]
-    );
+    state.err_code = FANSI_ERR_FATAL;
+    state.err_msg = FANSI_err_msg(FANSI_ERR_FATAL);
+    return state;
     // nocov end
+  }
 
   int err_code = 0;                       // track worst error code
 
@@ -496,12 +495,7 @@ static struct FANSI_state read_esc(struct FANSI_state state) {
           }
         }
         if(state.style > ((1 << (FANSI_STYLE_MAX + 1)) - 1))
-          // nocov start
-          error(
-            "Internal Error: style greater than FANSI_STYLE_MAX; ",
-            "contact maintainer."
-          );
-          // nocov end
+          state.err_code = FANSI_ERR_FATAL;  // nocov
 
         // `tok_res` value can't be used because code above, including
         // parse_colors can change the corresponding value in the `state`
@@ -547,24 +541,8 @@ static struct FANSI_state read_esc(struct FANSI_state state) {
     // !esc_recognized.
     state.err_code = err_code;  // b/c we want the worst err code
     state.last_char_width = 0;
-    if(err_code == 3) {
-      state.err_msg =
-        "a CSI SGR sequence with color codes not supported by terminal";
-    } else if(err_code < 4) {
-      state.err_msg = "a CSI SGR sequence with unknown substrings";
-    } else if (err_code == 4) {
-      state.err_msg = "a non-SGR CSI sequence";
-    } else if (err_code == 5) {
-      state.err_msg = "a malformed CSI sequence";
-    } else if (err_code == 6) {
-      state.err_msg = "a non-CSI escape sequence";
-    } else if (err_code == 7) {
-      state.err_msg = "a malformed escape sequence";
-    } else {
-      // nocov start
-      error("Internal Error: unknown ESC parse error; contact maintainer.");
-      // nocov end
-    }
+    if(err_code > 7) state.err_code = FANSI_ERR_FATAL;  // nocov
+    state.err_msg = FANSI_err_msg(state.err_code);
   } else {
     // Not 100% sure this is right...
     state.last_char_width = 1;
@@ -574,6 +552,10 @@ static struct FANSI_state read_esc(struct FANSI_state state) {
 }
 /*
  * Read UTF8 character
+ *
+ * In width mode (`state.use_nchar`) the display width is left for the R glue
+ * to look up (see `FANSI_read_next`), with `state.width_pending` set to the
+ * size of the character.
  */
 static struct FANSI_state read_utf8(struct FANSI_state state) {
   int byte_size = FANSI_utf8clen(state.string[state.pos_byte]);
@@ -582,8 +564,6 @@ static struct FANSI_state read_utf8(struct FANSI_state state) {
 
   int mb_err = 0;
   int disp_size = 0;
-  const char * mb_err_str =
-    "use `is.na(nchar(x, allowNA=TRUE))` to find problem strings.";
 
   for(int i = 1; i < byte_size; ++i) {
     if(!state.string[state.pos_byte + i]) {
@@ -599,31 +579,21 @@ static struct FANSI_state read_utf8(struct FANSI_state state) {
       // shouldn't actually be possible to reach this point since in all use
       // cases we chose to allowNA, except for `nchar_ctl`, which internally
       // uses `nchar` so would never get here anyway
-      error("invalid multiyte string, %s", mb_err_str);
+      state.err_code = FANSI_ERR_FATAL;
+      state.err_msg =
+        "invalid multiyte string, use `is.na(nchar(x, allowNA=TRUE))` to "
+        "find problem strings.";
+      return state;
       // nocov end
     }
+  } else if(state.use_nchar) {
+    state.width_pending = byte_size;
   } else {
-    // In order to compute char display width, we need to create a charsxp
-    // with the sequence in question.  Hopefully not too much overhead since
-    // at least we benefit from the global string hash table
-    //
-    // Note that we should probably not bother with computing this if display
-    // mode is not width as it's probably expensive.
-
-    if(state.use_nchar) {
-      SEXP str_chr =
-        PROTECT(mkCharLenCE(state.string + state.pos_byte, byte_size, CE_UTF8));
-      disp_size = R_nchar(
-        str_chr, Width, state.allowNA, state.keepNA, mb_err_str
-      );
-      UNPROTECT(1);
-    } else {
-      // This is not consistent with what we do with the padding where we use
-      // byte_size, but in this case we know we're supposed to be dealing
-      // with one char
+    // This is not consistent with what we do with the padding where we use
+    // byte_size, but in this case we know we're supposed to be dealing
+    // with one char
 
-      disp_size = 1;
-    }
+    disp_size = 1;
   }
   // Need to check overflow?  Really only for pos_width?  Maybe that's not
   // even true because you need at least two bytes to encode a double wide
@@ -634,7 +604,7 @@ static struct FANSI_state read_utf8(struct FANSI_state state) {
   ++state.pos_raw;
   if(disp_size == NA_INTEGER) {
     state.err_code = 9;
-    state.err_msg = "a malformed UTF-8 sequence";
+    state.err_msg = FANSI_err_msg(9);
     state.nchar_err = 1;
     disp_size = byte_size;
   }
@@ -651,7 +621,7 @@ static struct FANSI_state read_c0(struct FANSI_state state) {
   int is_nl = state.string[state.pos_byte] == '\n';
   if(!is_nl) {
     // question: should we make the comment about tabs as spaces?
-    state.err_msg = "a C0 control character";
+    state.err_msg = FANSI_err_msg(8);
     state.err_code = 8;
   }
   state = read_ascii(state);
@@ -667,13 +637,22 @@ static struct FANSI_state read_c0(struct FANSI_state state) {
   return state;
 }
 /*
- * Read a Character Off and Update State
+ * Read a Character Off and Update State, without using the R API
  *
- * This can probably use some pretty serious optimization...
+ * Everything above this point is plain C and only reads `state.string`, so
+ * this is safe to use from worker threads or in tight loops.  Problems are
+ * recorded in `state.err_code` (see `FANSI_err_msg`), including ones that
+ * should become R errors (`FANSI_ERR_FATAL`), and in width mode the width of
+ * UTF-8 characters is left for the caller to resolve (`state.width_pending`).
+ * `FANSI_read_next` does all of that for main thread callers.
  */
-struct FANSI_state FANSI_read_next(struct FANSI_state state) {
+struct FANSI_state FANSI_read_next_core(struct FANSI_state state) {
   const char chr_val = state.string[state.pos_byte];
   if(state.err_code) state.err_code = 0; // reset err code after each char
+  state.width_pending = 0;
+#ifdef FANSI_PERF
+  int pos_byte_prev = state.pos_byte;
+#endif
 
   // Normal ASCII characters
   if(chr_val >= 0x20 && chr_val < 0x7F) state = read_ascii(state);
@@ -684,6 +663,118 @@ struct FANSI_state FANSI_read_next(struct FANSI_state state) {
   // C0 escapes (e.g. \t, \n, etc)
   else if(chr_val) state = read_c0(state);
 
+  FANSI_PERF_ADD(FANSI_PERF_READ_NEXT, 1);
+  FANSI_PERF_ADD(FANSI_PERF_BYTES, state.pos_byte - pos_byte_prev);
+  return state;
+}
+/*
+ * Description of each `err_code`
+ */
+const char * FANSI_err_msg(int code) {
+  switch(code) {
+    case 1:
+    case 2: return "a CSI SGR sequence with unknown substrings";
+    case 3:
+      return "a CSI SGR sequence with color codes not supported by terminal";
+    case 4: return "a non-SGR CSI sequence";
+    case 5: return "a malformed CSI sequence";
+    case 6: return "a non-CSI escape sequence";
+    case 7: return "a malformed escape sequence";
+    case 8: return "a C0 control character";
+    case 9: return "a malformed UTF-8 sequence";
+  }
+  return "Internal Error: failed parsing string; contact maintainer.";
+}
+/*
+ * Record the first problem in an element
+ *
+ * Plain C, for use with `FANSI_read_next_core`.  A `FANSI_ERR_FATAL` replaces
+ * any earlier non-fatal record since it must be reported.
+ */
+void FANSI_diag_add(
+  struct FANSI_diag * diag, R_xlen_t elt, struct FANSI_state state
+) {
+  if(
+    state.err_code &&
+    (!diag->code || (
+      state.err_code == FANSI_ERR_FATAL && diag->code != FANSI_ERR_FATAL
+    ))
+  ) {
+    diag->elt = elt;
+    diag->pos = state.pos_byte;
+    diag->code = state.err_code;
+    diag->msg = state.err_msg;
+  }
+}
+// - R glue -------------------------------------------------------------------
+
+/*
+ * Signal the diagnostics collected with `FANSI_diag_add`
+ *
+ * Any fatal record becomes an error.  Otherwise, if `warn` is positive, the
+ * first problem in element order is warned about.
+ *
+ * @param diags one record per element (or per chunk of work), zero
+ *   initialized.
+ */
+void FANSI_diag_raise(const struct FANSI_diag * diags, R_xlen_t n, int warn) {
+  const struct FANSI_diag * first = NULL;
+  for(R_xlen_t i = 0; i < n; ++i) {
+    if(diags[i].code == FANSI_ERR_FATAL) error("%s", diags[i].msg); // nocov
+    if(!first && diags[i].code) first = diags + i;
+  }
+  if(first && warn > 0) {
+    warning(
+      "Encountered %s, %s%s", FANSI_err_msg(first->code),
+      "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
+      "off these warnings."
+    );
+  }
+}
+/*
+ * Look up the display width of a UTF-8 character read in width mode
+ */
+static struct FANSI_state read_width(struct FANSI_state state) {
+  // In order to compute char display width, we need to create a charsxp
+  // with the sequence in question.  Hopefully not too much overhead since
+  // at least we benefit from the global string hash table
+
+  int byte_size = state.width_pending;
+  state.width_pending = 0;
+  FANSI_PERF_ADD(FANSI_PERF_NCHAR, 1);
+  FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+  SEXP str_chr = PROTECT(
+    mkCharLenCE(state.string + state.pos_byte - byte_size, byte_size, CE_UTF8)
+  );
+  int disp_size = R_nchar(
+    str_chr, Width, state.allowNA, state.keepNA,
+    "use `is.na(nchar(x, allowNA=TRUE))` to find problem strings."
+  );
+  UNPROTECT(1);
+
+  if(disp_size == NA_INTEGER) {
+    state.err_code = 9;
+    state.err_msg = FANSI_err_msg(9);
+    state.nchar_err = 1;
+    disp_size = byte_size;
+  }
+  state.last_char_width = disp_size;
+  state.pos_width += disp_size;
+  state.pos_width_target += disp_size;
+  return state;
+}
+/*
+ * Read a Character Off and Update State
+ *
+ * `FANSI_read_next_core`, plus the parts that need R: raising errors, looking
+ * up display widths, and warning (once) about problems if `state.warn` is
+ * positive.
+ */
+struct FANSI_state FANSI_read_next(struct FANSI_state state) {
+  state = FANSI_read_next_core(state);
+  if(state.err_code == FANSI_ERR_FATAL) error("%s", state.err_msg); // nocov
+  if(state.width_pending) state = read_width(state);
+
   if(state.warn > 0 && state.err_code) {
     warning(
       "Encountered %s, %s%s", state.err_msg,
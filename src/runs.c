@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Decompose strings into runs of bytes that share an SGR state, and back
+ *
+ * A run is a maximal stretch of an element that is shown with one SGR state.
+ * Runs contain everything except escape sequences that are entirely SGR.
+ * Contiguous escape sequences that mix SGR and other sequences are kept as is
+ * at the start of the run with the state they leave the terminal in.  Since
+ * applying SGR is idempotent, writing such a run's state ahead of it does not
+ * change how it is displayed.
+ *
+ * States are interned in a hash table so each run only records an integer
+ * id.  Id 1 is always the blank state.
+ */
+
+struct runs_tab {
+  struct FANSI_sgr * sgr;   // unique states, in id order
+  int * slots;              // open addressing, 0 for empty, else id
+  int n;
+  int slots_n;              // a power of 2
+};
+
+/*
+ * Color extras may be stale after a basic color is set, so clear them to get
+ * a state that can be compared bytewise.
+ */
+static struct FANSI_sgr runs_canon(struct FANSI_state state) {
+  struct FANSI_sgr sgr = FANSI_sgr_from_state(state);
+  if(sgr.color != 8)
+    for(int i = 0; i < 4; ++i) sgr.color_extra[i] = 0;
+  if(sgr.bg_color != 8)
+    for(int i = 0; i < 4; ++i) sgr.bg_color_extra[i] = 0;
+  return sgr;
+}
+static unsigned int runs_hash(const struct FANSI_sgr * sgr) {
+  // FNV-1a; FANSI_sgr only has int members so has no padding
+
+  const unsigned char * byte = (const unsigned char *) sgr;
+  unsigned int hash = 2166136261U;
+  for(size_t i = 0; i < sizeof(struct FANSI_sgr); ++i)
+    hash = (hash ^ byte[i]) * 16777619U;
+  return hash;
+}
+static void runs_tab_resize(struct runs_tab * tab, int slots_n) {
+  int * slots = (int *) R_alloc(slots_n, sizeof(int));
+  struct FANSI_sgr * sgr =
+    (struct FANSI_sgr *) R_alloc(slots_n / 2, sizeof(struct FANSI_sgr));
+  memset(slots, 0, sizeof(int) * slots_n);
+  if(tab->n) memcpy(sgr, tab->sgr, sizeof(struct FANSI_sgr) * tab->n);
+
+  for(int id = 1; id <= tab->n; ++id) {
+    unsigned int k = runs_hash(sgr + id - 1) & (slots_n - 1);
+    while(slots[k]) k = (k + 1) & (slots_n - 1);
+    slots[k] = id;
+  }
+  tab->slots = slots;
+  tab->sgr = sgr;
+  tab->slots_n = slots_n;
+}
+/*
+ * @return the 1-based id of `sgr`, adding it to the table if needed
+ */
+static int runs_intern(struct runs_tab * tab, struct FANSI_sgr sgr) {
+  unsigned int k = runs_hash(&sgr) & (tab->slots_n - 1);
+  while(tab->slots[k]) {
+    int id = tab->slots[k];
+    if(!memcmp(tab->sgr + id - 1, &sgr, sizeof(struct FANSI_sgr))) return id;
+    k = (k + 1) & (tab->slots_n - 1);
+  }
+  if(tab->n + 1 > tab->slots_n / 2) {
+    if(tab->slots_n > FANSI_int_max / 2)
+      error("Too many distinct SGR states.");  // nocov
+    runs_tab_resize(tab, tab->slots_n * 2);
+    return runs_intern(tab, sgr);
+  }
+  tab->sgr[tab->n] = sgr;
+  tab->slots[k] = ++tab->n;
+  return tab->n;
+}
+/*
+ * Whether a contiguous run of escape sequences is made up only of SGR
+ */
+static int runs_sgr_only(const char * x, int bytes) {
+  const char * end = x + bytes;
+  while(x < end) {
+    if(*x != 27 || x[1] != '[') return 0;
+    const char * track = x + 2;
+    while(*track >= 0x30 && *track <= 0x3F) ++track;
+    if(*track != 'm') return 0;
+    x = track + 1;
+  }
+  return 1;
+}
+/*
+ * Output columns; see `FANSI_ctl_runs`
+ */
+struct runs_cols {
+  int * elt;
+  int * start;
+  int * stop;
+  int * byte_start;
+  int * byte_stop;
+  int * width;
+  int * style;
+};
+/*
+ * Count, or record, the runs of an element
+ *
+ * @param cols where to record the runs starting at offset `k`, or NULL to
+ *   only count them.
+ * @return the number of runs.
+ */
+static R_xlen_t runs_walk(
+  struct FANSI_state state, int elt, struct runs_cols * cols, R_xlen_t k,
+  struct runs_tab * tab, struct FANSI_state * state_end
+) {
+  R_xlen_t count = 0;
+  struct FANSI_sgr run_sgr = {.color=-1, .bg_color=-1};
+  struct FANSI_state run_start = state, run_end = state;
+
+  while(state.string[state.pos_byte]) {
+    struct FANSI_state next = FANSI_read_next(state);
+    const char * chr = state.string + state.pos_byte;
+
+    if(
+      *chr == 27 && next.pos_raw == state.pos_raw &&
+      runs_sgr_only(chr, next.pos_byte - state.pos_byte)
+    ) {
+      state = next;
+      continue;
+    }
+    struct FANSI_sgr sgr = runs_canon(next);
+    if(!count || memcmp(&sgr, &run_sgr, sizeof(struct FANSI_sgr))) {
+      if(count && cols) {
+        R_xlen_t j = k + count - 1;
+        cols->elt[j] = elt;
+        cols->start[j] = run_start.pos_raw + 1;
+        cols->stop[j] = run_end.pos_raw;
+        cols->byte_start[j] = run_start.pos_byte + 1;
+        cols->byte_stop[j] = run_end.pos_byte;
+        cols->width[j] = run_end.pos_width - run_start.pos_width;
+        cols->style[j] = runs_intern(tab, run_sgr);
+      }
+      ++count;
+      run_sgr = sgr;
+      run_start = state;
+    }
+    run_end = next;
+    state = next;
+  }
+  if(count && cols) {
+    R_xlen_t j = k + count - 1;
+    cols->elt[j] = elt;
+    cols->start[j] = run_start.pos_raw + 1;
+    cols->stop[j] = run_end.pos_raw;
+    cols->byte_start[j] = run_start.pos_byte + 1;
+    cols->byte_stop[j] = run_end.pos_byte;
+    cols->width[j] = run_end.pos_width - run_start.pos_width;
+    cols->style[j] = runs_intern(tab, run_sgr);
+  }
+  *state_end = state;
+  return count;
+}
+/*
+ * @param x a character vector, already in UTF-8
+ * @return a list with the run columns, in the order of `struct runs_cols`,
+ *   followed by the SGR sequence for each style id.
+ */
+SEXP FANSI_ctl_runs(SEXP x, SEXP warn, SEXP term_cap, SEXP ctl) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP || TYPEOF(ctl) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  if(x_len > FANSI_int_max)
+    error("Argument `x` may not be longer than INT_MAX.");
+
+  SEXP R_true = PROTECT(ScalarLogical(1));
+  SEXP R_one = PROTECT(ScalarInteger(1));
+  struct FANSI_state state_blank = FANSI_state_init_full(
+    "", warn, term_cap, R_true, R_true, R_one, ctl
+  );
+  // Count the runs so the columns can be allocated at their final size
+
+  R_xlen_t runs_n = 0;
+  int warned = 0;
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) continue;
+    FANSI_check_chrsxp(chr, i);
+
+    struct FANSI_state state = state_blank, state_end;
+    state.string = CHAR(chr);
+    if(warned) state.warn = -state.warn;
+    runs_n += runs_walk(state, (int) i + 1, NULL, 0, NULL, &state_end);
+    warned = warned || state_end.warn < 0;
+  }
+  SEXP res = PROTECT(allocVector(VECSXP, 8));
+  int * col_ptr[7];
+  for(int j = 0; j < 7; ++j) {
+    SET_VECTOR_ELT(res, j, allocVector(INTSXP, runs_n));
+    col_ptr[j] = INTEGER(VECTOR_ELT(res, j));
+  }
+  struct runs_cols cols = {
+    col_ptr[0], col_ptr[1], col_ptr[2], col_ptr[3], col_ptr[4], col_ptr[5],
+    col_ptr[6]
+  };
+  struct runs_tab tab = {.n = 0};
+  runs_tab_resize(&tab, 16);
+  runs_intern(&tab, runs_canon(state_blank));
+
+  R_xlen_t k = 0;
+  state_blank.warn = 0;
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) continue;
+
+    struct FANSI_state state = state_blank, state_end;
+    state.string = CHAR(chr);
+    k += runs_walk(state, (int) i + 1, &cols, k, &tab, &state_end);
+  }
+  SEXP styles = PROTECT(allocVector(STRSXP, tab.n));
+  for(int id = 0; id < tab.n; ++id) {
+    struct FANSI_state state = FANSI_sgr_to_state(tab.sgr[id], state_blank);
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SET_STRING_ELT(
+      styles, id, mkCharCE(FANSI_state_as_chr(state), CE_UTF8)
+    );
+  }
+  SET_VECTOR_ELT(res, 7, styles);
+  UNPROTECT(4);
+  return res;
+}
+/*
+ * Write each element from its runs
+ *
+ * @param elt, byte_start, byte_stop, style run columns as produced by
+ *   `FANSI_ctl_runs`, sorted by `elt`.
+ * @param styles the SGR sequence for each style id.
+ * @param terminate whether to close the SGR active at the end of each element.
+ */
+SEXP FANSI_runs_to_ctl(
+  SEXP x, SEXP elt, SEXP byte_start, SEXP byte_stop, SEXP style,
+  SEXP styles, SEXP term_cap, SEXP terminate
+) {
+  R_xlen_t runs_n = XLENGTH(elt);
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(elt) != INTSXP ||
+    TYPEOF(byte_start) != INTSXP || TYPEOF(byte_stop) != INTSXP ||
+    TYPEOF(style) != INTSXP || TYPEOF(styles) != STRSXP ||
+    TYPEOF(term_cap) != INTSXP || TYPEOF(terminate) != LGLSXP ||
+    XLENGTH(byte_start) != runs_n || XLENGTH(byte_stop) != runs_n ||
+    XLENGTH(style) != runs_n
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  R_xlen_t styles_n = XLENGTH(styles);
+  int term = asLogical(terminate);
+  const int * elt_p = INTEGER(elt), * start_p = INTEGER(byte_start),
+    * stop_p = INTEGER(byte_stop), * style_p = INTEGER(style);
+
+  SEXP R_false = PROTECT(ScalarLogical(0));
+  struct FANSI_state state_blank = FANSI_state_init("", R_false, term_cap);
+
+  // Read each style once
+
+  struct FANSI_sgr * sgr = (struct FANSI_sgr *)
+    R_alloc(styles_n ? styles_n : 1, sizeof(struct FANSI_sgr));
+  for(R_xlen_t j = 0; j < styles_n; ++j) {
+    SEXP chr = STRING_ELT(styles, j);
+    if(chr == NA_STRING) error("Styles may not be NA.");
+    struct FANSI_state state = state_blank;
+    state.string = CHAR(chr);
+    sgr[j] = FANSI_sgr_from_state(FANSI_read_esc_all(state, NULL, j));
+  }
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+  R_xlen_t r = 0;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    R_xlen_t r0 = r;
+    while(r < runs_n && elt_p[r] == i + 1) {
+      if(
+        style_p[r] < 1 || style_p[r] > styles_n ||
+        start_p[r] < 1 || stop_p[r] < start_p[r] - 1 ||
+        (chr != NA_STRING && stop_p[r] > LENGTH(chr))
+      )
+        error(
+          "Run %jd has an invalid style or byte range for element %jd.",
+          FANSI_ind(r), FANSI_ind(i)
+        );
+      ++r;
+    }
+    if(chr == NA_STRING) {
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    const char * string = CHAR(chr);
+
+    // Measure, then write
+
+    char * buff_track = NULL;
+    size_t size = 0;
+    for(int pass = 0; pass < 2; ++pass) {
+      struct FANSI_state state = state_blank;
+      size = 0;
+      for(R_xlen_t j = r0; j < r; ++j) {
+        struct FANSI_state want =
+          FANSI_sgr_to_state(sgr[style_p[j] - 1], state);
+        size += FANSI_csi_delta_write(
+          buff_track ? buff_track + size : NULL, state, want, 0
+        );
+        int bytes = stop_p[j] - start_p[j] + 1;
+        if(buff_track)
+          memcpy(buff_track + size, string + start_p[j] - 1, bytes);
+        size += bytes;
+        state = want;
+        if(size > (size_t) FANSI_int_max)
+          error(
+            "%s%s",
+            "Attempting to create string longer than INT_MAX while writing ",
+            "runs."
+          );
+      }
+      if(term)
+        size += FANSI_csi_delta_write(
+          buff_track ? buff_track + size : NULL, state, state_blank, 0
+        );
+      if(size > (size_t) FANSI_int_max)
+        error(
+          "%s%s",
+          "Attempting to create string longer than INT_MAX while writing ",
+          "runs."
+        );
+      if(!pass) {
+        FANSI_size_buff(&buff, size + 1);
+        buff_track = buff.buff;
+      }
+    }
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SET_STRING_ELT(
+      res, i, mkCharLenCE(buff.buff, (int) size, getCharCE(chr))
+    );
+  }
+  if(r < runs_n)
+    error("Internal Error: runs not sorted by element; contact maintainer.");
+  UNPROTECT(2);
+  return res;
+}
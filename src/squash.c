@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+/*
+ * Apply carriage returns, backspaces, and erase line sequences
+ *
+ * Each line is played into a buffer of screen cells as a terminal would, with
+ * a cursor that "\r" moves to the first column and "\b" moves back one
+ * column.  Characters overwrite the cell under the cursor, and "ESC[K" (and
+ * the "1K" and "2K" variants) blank cells.  Each cell records the SGR state
+ * the character was written with, so when the line is written out only the
+ * final visible characters remain, with the minimal SGR between them.
+ *
+ * Other escape sequences and C0 controls cannot be applied to the cells, so
+ * they are recorded along with the column the cursor was at and written right
+ * before that column's cell, in the order they were seen.
+ */
+
+/*
+ * A cell of a line
+ *
+ * `start` and `bytes` locate the character in the input, `bytes` is zero for
+ * blank cells.  `width` is zero for cells covered by the wide character to
+ * their left.
+ */
+struct sq_cell {
+  int start;
+  int bytes;
+  int width;
+  struct FANSI_sgr sgr;
+};
+/*
+ * A sequence written before the cell at `col`, `sgr` is the state before it
+ * and `sgr_after` the state it leaves the terminal in.
+ */
+struct sq_extra {
+  int col;
+  int seq;
+  int start;
+  int bytes;
+  struct FANSI_sgr sgr;
+  struct FANSI_sgr sgr_after;
+};
+struct sq_line {
+  struct sq_cell * cells;
+  struct sq_extra * extras;
+  int cells_cap;
+  int extras_cap;
+  int n;          // cells in use
+  int col;        // cursor
+  int extras_n;
+};
+/*
+ * Grow an array to hold at least `need` items, keeping the first `used`
+ */
+static void * sq_grow(void * old, int * cap, int need, int used, size_t size) {
+  if(need <= *cap) return old;
+  if(need < 0) error("Line too long to squash.");  // overflow
+
+  int cap_new = *cap > FANSI_int_max / 2 ? FANSI_int_max : *cap * 2;
+  if(cap_new < need) cap_new = need;
+  if(cap_new < 64) cap_new = 64;
+  void * res = R_alloc((size_t) cap_new, size);
+  if(used) memcpy(res, old, (size_t) used * size);
+  *cap = cap_new;
+  return res;
+}
+static void sq_blank(struct sq_cell * cell, struct FANSI_sgr sgr) {
+  *cell = (struct sq_cell) {.width = 1, .sgr = sgr};
+}
+/*
+ * Make room for cells up to (but excluding) `end`, filling any gap beyond the
+ * current end of the line with blanks
+ */
+static void sq_fill(struct sq_line * line, int end, struct FANSI_sgr sgr) {
+  if(end <= line->n) return;
+  line->cells = sq_grow(
+    line->cells, &line->cells_cap, end, line->n, sizeof(struct sq_cell)
+  );
+  for(int k = line->n; k < end; ++k) sq_blank(line->cells + k, sgr);
+  line->n = end;
+}
+/*
+ * Blank wide characters that straddle either edge of [start, end)
+ */
+static void sq_split_wide(
+  struct sq_line * line, int start, int end, struct FANSI_sgr sgr
+) {
+  struct sq_cell * cells = line->cells;
+  if(start < line->n && !cells[start].width) {
+    int k = start;
+    while(k > 0 && !cells[k].width) sq_blank(cells + k--, sgr);
+    sq_blank(cells + k, sgr);
+  }
+  if(end < line->n && !cells[end].width) {
+    for(int k = end; k < line->n && !cells[k].width; ++k)
+      sq_blank(cells + k, sgr);
+  }
+}
+static void sq_extra(
+  struct sq_line * line, int start, int bytes, struct FANSI_sgr sgr,
+  struct FANSI_sgr sgr_after
+) {
+  line->extras = sq_grow(
+    line->extras, &line->extras_cap, line->extras_n + 1, line->extras_n,
+    sizeof(struct sq_extra)
+  );
+  line->extras[line->extras_n] = (struct sq_extra) {
+    .col = line->col, .seq = line->extras_n, .start = start, .bytes = bytes,
+    .sgr = sgr, .sgr_after = sgr_after
+  };
+  ++line->extras_n;
+}
+static void sq_put(
+  struct sq_line * line, int start, int bytes, int width, struct FANSI_sgr sgr
+) {
+  int col = line->col;
+  if(width < 1) {
+    // Zero width, e.g. combining characters; attach to the prior character if
+    // it immediately precedes this one in the input.
+
+    int k = col - 1;
+    while(k > 0 && k < line->n && !line->cells[k].width) --k;
+    if(
+      k >= 0 && k < line->n && line->cells[k].bytes &&
+      line->cells[k].start + line->cells[k].bytes == start
+    ) {
+      line->cells[k].bytes += bytes;
+    } else sq_extra(line, start, bytes, sgr, sgr);
+    return;
+  }
+  if(col > FANSI_int_max - width) error("Line too long to squash.");
+  sq_fill(line, col, sgr);
+  sq_split_wide(line, col, col + width, sgr);
+  sq_fill(line, col + width, sgr);
+  line->cells[col] =
+    (struct sq_cell) {.start=start, .bytes=bytes, .width=width, .sgr=sgr};
+  for(int k = 1; k < width; ++k)
+    line->cells[col + k] = (struct sq_cell) {.width=0, .sgr=sgr};
+  line->col += width;
+}
+/*
+ * @param mode 0 to erase from the cursor to the end of the line, 1 from the
+ *   start of the line to the cursor, 2 the whole line.
+ */
+static void sq_erase(struct sq_line * line, int mode, struct FANSI_sgr sgr) {
+  int col = line->col;
+  if(mode == 0) {
+    if(col < line->n) {
+      sq_split_wide(line, col, line->n, sgr);
+      line->n = col;
+    }
+  } else if(mode == 1) {
+    if(col == FANSI_int_max) error("Line too long to squash.");
+    sq_fill(line, col + 1, sgr);
+    sq_split_wide(line, 0, col + 1, sgr);
+    for(int k = 0; k <= col; ++k) sq_blank(line->cells + k, sgr);
+  } else line->n = 0;
+}
+/*
+ * Length of the escape sequence at `x`, see FANSI_find_esc
+ */
+static int sq_esc_len(const char * x) {
+  const char * track = x + 1;
+  if(*track == '[') {
+    ++track;
+    while(*track >= 0x30 && *track <= 0x3F) ++track;
+    while(*track >= 0x20 && *track <= 0x2F) ++track;
+    if(!(*track >= 0x40 && *track <= 0x7E))
+      while(*track >= 0x20 && *track <= 0x3F) ++track;
+  }
+  if(*track && *track != 27) ++track;
+  return (int) (track - x);
+}
+/*
+ * @return the erase line mode of the sequence at `x` (see `sq_erase`), or -1
+ *   if it is not an erase line sequence.
+ */
+static int sq_erase_mode(const char * x, int len) {
+  if(len < 3 || x[1] != '[' || x[len - 1] != 'K') return -1;
+  if(len == 3) return 0;
+  if(len == 4 && x[2] >= '0' && x[2] <= '2') return x[2] - '0';
+  return -1;
+}
+/*
+ * Whether an element has anything to squash
+ */
+static int sq_needed(const char * x) {
+  for(; *x; ++x) {
+    if(*x == '\r' || *x == '\b') return 1;
+    if(*x == 27) {
+      int len = sq_esc_len(x);
+      if(sq_erase_mode(x, len) >= 0) return 1;
+      x += len - 1;
+  } }
+  return 0;
+}
+static int sq_extra_comp(const void * a, const void * b) {
+  const struct sq_extra * x = a, * y = b;
+  if(x->col != y->col) return (x->col > y->col) - (x->col < y->col);
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+static size_t sq_write_extra(
+  const struct sq_extra * extra, const char * string, char * buff,
+  struct FANSI_state * term
+) {
+  size_t size = FANSI_csi_delta_write(
+    buff, *term, FANSI_sgr_to_state(extra->sgr, *term), 0
+  );
+  if(buff) memcpy(buff + size, string + extra->start, extra->bytes);
+  *term = FANSI_sgr_to_state(extra->sgr_after, *term);
+  return size + (size_t) extra->bytes;
+}
+/*
+ * Write out a line and reset it
+ *
+ * @param state the input state at the end of the line, which the output is
+ *   brought to after the last cell.
+ * @return the number of bytes written
+ */
+static size_t sq_flush(
+  struct sq_line * line, struct FANSI_state state, char * buff,
+  struct FANSI_state * term
+) {
+  const char * string = state.string;
+  size_t size = 0;
+  int e = 0;
+  if(line->extras_n > 1)
+    qsort(
+      line->extras, line->extras_n, sizeof(struct sq_extra), sq_extra_comp
+    );
+
+  for(int k = 0; k < line->n; ++k) {
+    for(; e < line->extras_n && line->extras[e].col <= k; ++e)
+      size += sq_write_extra(
+        line->extras + e, string, buff ? buff + size : NULL, term
+      );
+
+    const struct sq_cell * cell = line->cells + k;
+    if(!cell->width) continue;
+    struct FANSI_state want = FANSI_sgr_to_state(cell->sgr, *term);
+    size += FANSI_csi_delta_write(buff ? buff + size : NULL, *term, want, 0);
+    *term = want;
+    if(cell->bytes) {
+      if(buff) memcpy(buff + size, string + cell->start, cell->bytes);
+      size += cell->bytes;
+    } else {
+      if(buff) buff[size] = ' ';
+      ++size;
+    }
+  }
+  for(; e < line->extras_n; ++e)
+    size += sq_write_extra(
+      line->extras + e, string, buff ? buff + size : NULL, term
+    );
+
+  size += FANSI_csi_delta_write(buff ? buff + size : NULL, *term, state, 0);
+  *term = FANSI_state_copy_style(*term, state);
+
+  line->n = line->col = line->extras_n = 0;
+  return size;
+}
+/*
+ * Compute the size of, or write, the squashed element
+ *
+ * @param buff where to write, or NULL to only compute the size.  Does not
+ *   write the NULL terminator.
+ * @param scratch used to NULL terminate each escape sequence to read it.
+ * @param state_end set to the state at the end of the element.
+ * @return the size of the squashed string.
+ */
+static int sq_walk(
+  struct FANSI_state state, char * buff, struct sq_line * line,
+  struct FANSI_buff * scratch, struct FANSI_state * state_end
+) {
+  const char * string = state.string;
+  struct FANSI_state term = state;
+  size_t size = 0;
+  int i = 0;
+  line->n = line->col = line->extras_n = 0;
+
+  while(string[i]) {
+    char chr = string[i];
+    int bytes = 1;
+    if(chr == '\n') {
+      size += sq_flush(line, state, buff ? buff + size : NULL, &term);
+      if(buff) buff[size] = '\n';
+      ++size;
+    } else if(chr == '\r') {
+      line->col = 0;
+    } else if(chr == '\b') {
+      if(line->col) --line->col;
+    } else if(chr == 27 || (chr > 0 && chr < 0x20) || chr == 0x7F) {
+      // Escape sequences and other C0 controls; SGR is applied to the state,
+      // the rest are recorded to be written back as is.
+
+      bytes = chr == 27 ? sq_esc_len(string + i) : 1;
+      int erase = chr == 27 ? sq_erase_mode(string + i, bytes) : -1;
+      struct FANSI_sgr sgr = FANSI_sgr_from_state(state);
+      if(erase >= 0) {
+        sq_erase(line, erase, sgr);
+      } else {
+        FANSI_size_buff(scratch, (size_t) bytes + 1);
+        memcpy(scratch->buff, string + i, bytes);
+        scratch->buff[bytes] = 0;
+        struct FANSI_state read = state;
+        read.string = scratch->buff;
+        read.pos_byte = 0;
+        read = FANSI_read_next(read);
+        state = FANSI_state_copy_style(state, read);
+        state.warn = read.warn;
+        if(read.err_code)
+          sq_extra(line, i, bytes, sgr, FANSI_sgr_from_state(state));
+      }
+    } else {
+      int width = 1;
+      if(chr < 0) {
+        struct FANSI_state read = state;
+        read.pos_byte = i;
+        read = FANSI_read_next(read);
+        bytes = read.pos_byte - i;
+        width = read.last_char_width;
+        state.warn = read.warn;
+      }
+      sq_put(line, i, bytes, width, FANSI_sgr_from_state(state));
+    }
+    if(size > (size_t) FANSI_int_max)
+      error(
+        "%s%s",
+        "Attempting to create string longer than INT_MAX while squashing ",
+        "overwritten characters."
+      );
+    i += bytes;
+  }
+  size += sq_flush(line, state, buff ? buff + size : NULL, &term);
+  if(size > (size_t) FANSI_int_max)
+    error(
+      "%s%s",
+      "Attempting to create string longer than INT_MAX while squashing ",
+      "overwritten characters."
+    );
+  *state_end = state;
+  return (int) size;
+}
+/*
+ * @param x a character vector, already in UTF-8
+ */
+SEXP FANSI_squash(SEXP x, SEXP warn, SEXP term_cap) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  int warned = 0;
+
+  SEXP R_true = PROTECT(ScalarLogical(1));
+  SEXP R_one = PROTECT(ScalarInteger(1));
+  SEXP res = PROTECT(allocVector(STRSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+  struct FANSI_buff scratch = {.len = 0};
+  struct sq_line line = {.cells = NULL};
+
+  // Width mode so wide characters take two cells, all controls recognized
+
+  struct FANSI_state state_blank = FANSI_state_init_full(
+    "", warn, term_cap, R_true, R_true, R_one, R_one
+  );
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    SET_STRING_ELT(res, i, chr);
+    if(chr == NA_STRING) continue;
+    FANSI_check_chrsxp(chr, i);
+
+    const char * string = CHAR(chr);
+    if(!sq_needed(string)) continue;
+
+    struct FANSI_state state = state_blank;
+    state.string = string;
+    if(warned) state.warn = -state.warn;
+
+    // Measure, then write
+
+    struct FANSI_state state_end;
+    int size = sq_walk(state, NULL, &line, &scratch, &state_end);
+    warned = warned || state_end.warn < 0;
+    FANSI_size_buff(&buff, (size_t) size + 1);
+    state.warn = 0;
+    sq_walk(state, buff.buff, &line, &scratch, &state_end);
+    buff.buff[size] = 0;
+
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SET_STRING_ELT(res, i, mkCharLenCE(buff.buff, size, getCharCE(chr)));
+  }
+  UNPROTECT(3);
+  return res;
+}
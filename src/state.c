@@ -32,16 +32,6 @@ struct FANSI_state FANSI_state_init_full(
   SEXP width, SEXP ctl
 ) {
   // nocov start
-  if(TYPEOF(warn) != LGLSXP)
-    error(
-      "Internal error: state_init with bad type for warn (%s)",
-      type2char(TYPEOF(warn))
-    );
-  if(TYPEOF(term_cap) != INTSXP)
-    error(
-      "Internal error: state_init with bad type for term_cap (%s)",
-      type2char(TYPEOF(term_cap))
-    );
   if(TYPEOF(allowNA) != LGLSXP)
     error(
       "Internal error: state_init with bad type for allowNA (%s)",
@@ -57,6 +47,31 @@ struct FANSI_state FANSI_state_init_full(
       "Internal error: state_init with bad type for width (%s)",
       type2char(TYPEOF(width))
     );
+  // nocov end
+  return FANSI_state_init_opts(
+    string, FANSI_opts_sxp(warn, term_cap, ctl), asLogical(allowNA),
+    asLogical(keepNA), asInteger(width)
+  );
+}
+/*
+ * Resolve the `warn`, `term_cap`, and `ctl` .Call arguments into the settings
+ * `FANSI_state_init_opts` uses.
+ *
+ * Functions that initialize a state per element should call this once ahead
+ * of the loop instead of using `FANSI_state_init_full` in it.
+ */
+struct FANSI_opts FANSI_opts_sxp(SEXP warn, SEXP term_cap, SEXP ctl) {
+  // nocov start
+  if(TYPEOF(warn) != LGLSXP)
+    error(
+      "Internal error: state_init with bad type for warn (%s)",
+      type2char(TYPEOF(warn))
+    );
+  if(TYPEOF(term_cap) != INTSXP)
+    error(
+      "Internal error: state_init with bad type for term_cap (%s)",
+      type2char(TYPEOF(term_cap))
+    );
   if(TYPEOF(ctl) != INTSXP)
     error(
       "Internal error: state_init with bad type for ctl (%s)",
@@ -66,7 +81,6 @@ struct FANSI_state FANSI_state_init_full(
   // nocov end
 
   int * term_int = INTEGER(term_cap);
-  int warn_int = asInteger(warn);
   int term_cap_int = 0;
 
   R_xlen_t i_len = XLENGTH(term_cap);
@@ -80,16 +94,31 @@ struct FANSI_state FANSI_state_init_full(
 
     term_cap_int |= 1 << (term_int[i] - 1);
   }
+  return (struct FANSI_opts) {
+    .warn = asInteger(warn), .term_cap = term_cap_int,
+    .ctl = FANSI_ctl_as_int(ctl)
+  };
+}
+/*
+ * As `FANSI_state_init_full`, but with settings that are already resolved,
+ * e.g. by `FANSI_opts_sxp` or from a `fansi_opts` object.
+ *
+ * @param width 0 for chars, 1 for width.
+ */
+struct FANSI_state FANSI_state_init_opts(
+  const char * string, struct FANSI_opts opts, int allowNA, int keepNA,
+  int width
+) {
   return (struct FANSI_state) {
     .string = string,
     .color = -1,
     .bg_color = -1,
-    .warn = warn_int,
-    .term_cap = term_cap_int,
-    .allowNA = asLogical(allowNA),
-    .keepNA = asLogical(keepNA),
-    .use_nchar = asInteger(width),  // 0 for chars, 1 for width
-    .ctl = FANSI_ctl_as_int(ctl)
+    .warn = opts.warn,
+    .term_cap = opts.term_cap,
+    .allowNA = allowNA,
+    .keepNA = keepNA,
+    .use_nchar = width,
+    .ctl = opts.ctl
   };
 }
 struct FANSI_state FANSI_state_init(
@@ -559,11 +588,150 @@ int FANSI_csi_write(char * buff, struct FANSI_state state, int buff_len) {
   }
   return str_pos;
 }
+/*
+ * Write an SGR token followed by ';', return bytes written
+ */
+static int csi_tok(char * buff, int val) {
+  int len = sprintf(buff, "%d;", val);
+  if(len < 0) error("Internal Error: failed writing SGR token.");  // nocov
+  return len;
+}
+static int color_comp(int color, int * extra, int color_b, int * extra_b) {
+  if(color != color_b) return 1;
+  if(color != 8) return 0;
+  for(int i = 0; i < 4; ++i) if(extra[i] != extra_b[i]) return 1;
+  return 0;
+}
+/*
+ * Write the shortest CSI SGR sequence that changes `from` into `to`
+ *
+ * This is either a delta that turns off what `from` has that `to` doesn't and
+ * turns on the rest, or a full reset followed by `to`.  Some off codes turn off
+ * more than one attribute (e.g. 22 for both bold and faint), in which case we
+ * turn back on those that should remain.
+ *
+ * @param buff where to write the sequence, or NULL to just compute the size.
+ *   DOES NOT ADD NULL TERMINATOR.
+ * @param normalize whether to only use the codes that turn off specific
+ *   attributes (e.g. 39 for the foreground color) instead of the reset, even
+ *   if the reset is shorter.
+ * @return how many bytes were (or would be) written, zero if the SGR parts of
+ *   the states are the same.
+ */
+int FANSI_csi_delta_write(
+  char * buff, struct FANSI_state from, struct FANSI_state to, int normalize
+) {
+  if(!FANSI_state_comp(from, to)) return 0;
+
+  // Largest possible delta is well under 256 bytes; see FANSI_state_size
+
+  char tmp[256];
+  int pos = 2;
+  tmp[0] = 27;
+  tmp[1] = '[';
+
+  // Off codes and which bits they turn off
+
+  static const unsigned int style_off_bits[] = {
+    (1U << 1) | (1U << 2), (1U << 3) | (1U << 10), (1U << 4) | (1U << 11),
+    (1U << 5) | (1U << 6), 1U << 7, 1U << 8, 1U << 9, 1U << 12
+  };
+  static const int style_off_code[] = {22, 23, 24, 25, 27, 28, 29, 50};
+  static const unsigned int border_off_bits[] = {
+    (1U << 1) | (1U << 2), 1U << 3
+  };
+  static const int border_off_code[] = {54, 55};
+
+  // Same order as FANSI_csi_write; off codes go ahead of on codes
+
+  unsigned int style_on = to.style & ~from.style;
+  unsigned int style_off = from.style & ~to.style;
+  for(int i = 0; i < 8; ++i) {
+    if(style_off & style_off_bits[i]) {
+      pos += csi_tok(tmp + pos, style_off_code[i]);
+      style_on |= to.style & style_off_bits[i];
+  } }
+  for(int i = 1; i < 10; ++i)
+    if(style_on & (1U << i)) pos += csi_tok(tmp + pos, i);
+  if(style_on & (1U << 10)) pos += csi_tok(tmp + pos, 20);
+  if(style_on & (1U << 11)) pos += csi_tok(tmp + pos, 21);
+  if(style_on & (1U << 12)) pos += csi_tok(tmp + pos, 26);
+
+  if(
+    color_comp(from.color, from.color_extra, to.color, to.color_extra)
+  ) {
+    if(to.color < 0) pos += csi_tok(tmp + pos, 39);
+    else pos += FANSI_color_write(tmp + pos, to.color, to.color_extra, 3);
+  }
+  if(
+    color_comp(
+      from.bg_color, from.bg_color_extra, to.bg_color, to.bg_color_extra
+  ) ) {
+    if(to.bg_color < 0) pos += csi_tok(tmp + pos, 49);
+    else pos += FANSI_color_write(
+      tmp + pos, to.bg_color, to.bg_color_extra, 4
+    );
+  }
+  unsigned int border_on = to.border & ~from.border;
+  unsigned int border_off = from.border & ~to.border;
+  for(int i = 0; i < 2; ++i) {
+    if(border_off & border_off_bits[i]) {
+      pos += csi_tok(tmp + pos, border_off_code[i]);
+      border_on |= to.border & border_off_bits[i];
+  } }
+  for(int i = 1; i < 4; ++i)
+    if(border_on & (1U << i)) pos += csi_tok(tmp + pos, 50 + i);
+
+  unsigned int ideogram_on = to.ideogram & ~from.ideogram;
+  if(from.ideogram & ~to.ideogram) {
+    pos += csi_tok(tmp + pos, 65);  // turns off all ideogram
+    ideogram_on = to.ideogram;
+  }
+  for(int i = 0; i < 5; ++i)
+    if(ideogram_on & (1U << i)) pos += csi_tok(tmp + pos, 60 + i);
+
+  if(from.font != to.font)
+    pos += csi_tok(tmp + pos, to.font ? to.font : 10);
+
+  // States may differ only in stale color extras, which don't matter
+
+  if(pos == 2) return 0;
+  tmp[pos - 1] = 'm';
+
+  // Compare against a reset followed by the full state; "ESC[0;" replaces the
+  // "ESC[" of the full state.
+
+  int to_size = FANSI_state_size(to);
+  int reset_size = to_size ? to_size + 2 : 4;
+
+  if(!normalize && reset_size < pos) {
+    if(buff) {
+      if(to_size) {
+        memcpy(buff, "\033[0;", 4);
+        char tmp_state[256];
+        FANSI_csi_write(tmp_state, to, to_size);
+        memcpy(buff + 4, tmp_state + 2, to_size - 2);
+      } else memcpy(buff, "\033[0m", 4);
+    }
+    return reset_size;
+  }
+  if(buff) memcpy(buff, tmp, pos);
+  return pos;
+}
 /*
  * Generate the ANSI tag corresponding to the state and write it out as a NULL
  * terminated string.
  */
 char * FANSI_state_as_chr(struct FANSI_state state) {
+  return FANSI_state_as_chr_arena(state, NULL);
+}
+/*
+ * Same as `FANSI_state_as_chr`, but allocating from `arena`, see
+ * `FANSI_arena_alloc`.
+ */
+char * FANSI_state_as_chr_arena(
+  struct FANSI_state state, struct FANSI_arena * arena
+) {
   // First pass computes total size of tag; we need to account for the
   // separator as well
 
@@ -571,7 +739,7 @@ char * FANSI_state_as_chr(struct FANSI_state state) {
 
   // Now allocate and generate tag
 
-  char * tag_tmp = R_alloc(tag_len + 1, sizeof(char));
+  char * tag_tmp = FANSI_arena_alloc(arena, (size_t) tag_len + 1);
   int tag_len_written = FANSI_csi_write(tag_tmp, state, tag_len);
   if(tag_len_written > tag_len)
     error("Internal Error: CSI written larger than expected."); // nocov
@@ -738,6 +906,7 @@ SEXP FANSI_state_at_pos_ext(
 
   int type_int = asInteger(type);
   int pos_i, pos_prev = -1;
+  struct FANSI_arena arena = {.len = 0};
 
   for(R_xlen_t i = 0; i < len; i++) {
     R_CheckUserInterrupt();
@@ -776,7 +945,8 @@ SEXP FANSI_state_at_pos_ext(
       // Record color tag if state changed
 
       if(FANSI_state_comp(state, state_prev)) {
-        res_chr = PROTECT(mkChar(FANSI_state_as_chr(state)));
+        FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+        res_chr = PROTECT(mkChar(FANSI_state_as_chr_arena(state, &arena)));
       } else {
         res_chr = PROTECT(res_chr_prev);
       }
@@ -17,6 +17,100 @@
  */
 
 #include "fansi.h"
+
+static void strip_warn(SEXP res, R_xlen_t invalid_idx, int warn_int) {
+  switch(warn_int) {
+    case 1: {
+      warning(
+        "Encountered %s index [%jd], %s%s",
+        "invalid or possibly incorreclty handled ESC sequence at ",
+        FANSI_ind(invalid_idx),
+        "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
+        "off these warnings."
+      );
+      break;
+    }
+    case 2: {
+      SEXP attrib_val = PROTECT(ScalarLogical(1));
+      setAttrib(res, FANSI_warn_sym, attrib_val);
+      UNPROTECT(1);
+      break;
+} } }
+/*
+ * Multi-threaded version of `FANSI_strip`
+ *
+ * Each element is stripped into its own slot of a buffer as large as all the
+ * input strings combined.  `res_len` records how many bytes each stripped
+ * element occupies, or -1 if there was nothing to strip.  We then create the
+ * CHARSXPs back on the main thread.
+ */
+static SEXP strip_par(
+  SEXP x, int ctl_int, int warn_int, struct FANSI_par par
+) {
+  char * buff = R_alloc(par.total + 1, sizeof(char));
+  int * res_len = (int *) R_alloc(par.len, sizeof(int));
+  char * invalid = R_alloc(par.len, sizeof(char));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+  for(int k = 0; k < par.threads; ++k) {
+    for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+      const char * chr = par.chrs[i];
+      res_len[i] = -1;
+      invalid[i] = 0;
+      if(!chr) continue;
+
+      const char * chr_track = chr;
+      char * res_track = buff + par.offs[i];
+
+      while(1) {
+        struct FANSI_csi_pos csi = FANSI_find_esc(chr_track, ctl_int);
+        if(!csi.valid || ((csi.ctl & FANSI_CTL_ESC) & ctl_int))
+          invalid[i] = 1;
+        if(!csi.len) break;
+        memcpy(res_track, chr_track, csi.start - chr_track);
+        res_track += csi.start - chr_track;
+        chr_track = csi.start + csi.len;
+      }
+      if(chr_track != chr) {
+        const char * chr_end = chr + par.lens[i];
+        memcpy(res_track, chr_track, chr_end - chr_track);
+        res_track += chr_end - chr_track;
+        res_len[i] = (int)(res_track - (buff + par.offs[i]));
+  } } }
+  // Back on the main thread
+
+  SEXP res_fin = x;
+  PROTECT_INDEX ipx;
+  PROTECT_WITH_INDEX(res_fin, &ipx);
+  int any_ansi = 0;
+  int invalid_ansi = 0;
+  R_xlen_t invalid_idx = 0;
+
+  for(R_xlen_t i = 0; i < par.len; ++i) {
+    FANSI_interrupt(i);
+    if(!invalid_ansi && invalid[i]) {
+      invalid_ansi = 1;
+      invalid_idx = i;
+    }
+    if(res_len[i] < 0) continue;
+    if(!any_ansi) {
+      any_ansi = 1;
+      REPROTECT(res_fin = duplicate(x), ipx);
+    }
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SEXP chr_sexp = PROTECT(
+      mkCharLenCE(
+        buff + par.offs[i], res_len[i], getCharCE(STRING_ELT(x, i))
+    ) );
+    SET_STRING_ELT(res_fin, i, chr_sexp);
+    UNPROTECT(1);
+  }
+  if(invalid_ansi) strip_warn(res_fin, invalid_idx, warn_int);
+  UNPROTECT(1);
+  return res_fin;
+}
 /*
  * Strips ANSI tags from input
  *
@@ -31,6 +125,17 @@
  *   actually throwing the warning
  */
 
+/*
+ * Sequential stripping, see `FANSI_strip`
+ */
+struct strip_call {
+  SEXP x;
+  int ctl_int;
+  int warn_int;
+  struct FANSI_buff buff;
+};
+static SEXP strip(void * data);
+
 SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
   if(TYPEOF(x) != STRSXP)
     error("Argument `x` should be a character vector.");  // nocov
@@ -49,6 +154,22 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
   // Compress `ctl` into a single integer using bit flags
 
   int ctl_int = FANSI_ctl_as_int(ctl);
+
+  int threads = FANSI_threads();
+  if(threads > 1) {
+    struct FANSI_par par = FANSI_par_init(x, threads);
+    if(par.threads > 1) return strip_par(x, ctl_int, warn_int, par);
+  }
+  struct strip_call call = {
+    .x=x, .ctl_int=ctl_int, .warn_int=warn_int, .buff={.len=0}
+  };
+  return FANSI_with_buff(strip, &call, &call.buff);
+}
+static SEXP strip(void * data) {
+  struct strip_call * call = (struct strip_call *) data;
+  SEXP x = call->x;
+  int ctl_int = call->ctl_int, warn_int = call->warn_int;
+
   R_xlen_t i, len = xlength(x);
   SEXP res_fin = x;
 
@@ -144,7 +265,8 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
           // The character buffer is large enough for the largest element in the
           // vector, and is re-used for every element in the vector.
 
-          chr_buff = (char *) R_alloc(mem_req + 1, sizeof(char));
+          FANSI_size_buff(&call->buff, (size_t) mem_req + 1);
+          chr_buff = call->buff.buff;
           res_start = res_track = chr_buff;
         }
         // Is memcpy going to cause problems again by reading past end of
@@ -178,6 +300,7 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
       *res_track = '\0';
 
       FANSI_check_chr_size(res_start, res_track, i);
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
       SEXP chr_sexp = PROTECT(
         mkCharLenCE(
           res_start, res_track - res_start, getCharCE(x_chr)
@@ -186,24 +309,7 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
       UNPROTECT(1);
     }
   }
-  if(invalid_ansi) {
-    switch(warn_int) {
-      case 1: {
-        warning(
-          "Encountered %s index [%jd], %s%s",
-          "invalid or possibly incorreclty handled ESC sequence at ",
-          FANSI_ind(invalid_idx),
-          "see `?unhandled_ctl`; you can use `warn=FALSE` to turn ",
-          "off these warnings."
-        );
-        break;
-      }
-      case 2: {
-        SEXP attrib_val = PROTECT(ScalarLogical(1));
-        setAttrib(res_fin, FANSI_warn_sym, attrib_val);
-        UNPROTECT(1);
-        break;
-  } } }
+  if(invalid_ansi) strip_warn(res_fin, invalid_idx, warn_int);
   UNPROTECT(1);
   return res_fin;
 }
@@ -386,6 +492,7 @@ SEXP FANSI_process(SEXP input, struct FANSI_buff *buff) {
     if(strip_this) {
       *(buff_track) = 0;
       FANSI_check_chr_size(buff->buff, buff_track, i);
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
       SEXP chrsxp = PROTECT(
         mkCharLenCE(
           buff->buff, buff_track - buff->buff, getCharCE(STRING_ELT(input, i))
@@ -398,7 +505,15 @@ SEXP FANSI_process(SEXP input, struct FANSI_buff *buff) {
   return res;
 }
 
+struct process_call {
+  SEXP input;
+  struct FANSI_buff buff;
+};
+static SEXP process(void * data) {
+  struct process_call * call = (struct process_call *) data;
+  return FANSI_process(call->input, &call->buff);
+}
 SEXP FANSI_process_ext(SEXP input) {
-  struct FANSI_buff buff = {.len=0};
-  return FANSI_process(input, &buff);
+  struct process_call call = {.input=input, .buff={.len=0}};
+  return FANSI_with_buff(process, &call, &call.buff);
 }
@@ -17,136 +17,500 @@
  */
 
 #include "fansi.h"
-// nocov start
-// this is a temporarily un-used implementation, but we may re-use it later
 
-SEXP FANSI_strsplit(SEXP x, SEXP warn, SEXP term_cap) {
-  error("This code is disabled currently.");
-  warning("Handle UTF8");
-  // UTF8 is a little tricky here, we're now using read_next, but we don't
-  // really need it, so we could maybe have a version without read next that
-  // doesn't need to translate to UTF8.
+/*
+ * Split strings at positions computed on their stripped counterparts
+ *
+ * The R side runs `gregexpr` (or `fixed` matching) on the stripped strings, and
+ * we map the match offsets back onto the original strings in a single forward
+ * scan per element, writing each piece with the SGR state active at its start
+ * and a closing SGR if there is any state active at its end.
+ *
+ * Match offsets are in characters, or in bytes if the match was done with
+ * `useBytes`, so we track the visible position in those units.
+ */
+
+struct split_pos {
+  struct FANSI_state state;
+  int vis;
+};
+
+static struct split_pos split_read(struct split_pos pos, int bytes) {
+  struct FANSI_state next = FANSI_read_next(pos.state);
+  int d_raw = next.pos_raw - pos.state.pos_raw;
+
+  // Only UTF-8 characters are multi byte; everything else that is visible is
+  // read one byte per `pos_raw`.
+
+  const char * chr = pos.state.string + pos.state.pos_byte;
+  if(bytes && d_raw && (unsigned char) *chr > 0x7f)
+    pos.vis += next.pos_byte - pos.state.pos_byte;
+  else pos.vis += d_raw;
+
+  pos.state = next;
+  return pos;
+}
+/*
+ * Advance until `n` visible units have been read, or the end of the string,
+ * stopping right after the last visible unit so that any trailing escapes are
+ * left for the next piece.
+ */
+static struct split_pos split_to(struct split_pos pos, int n, int bytes) {
+  struct split_pos end = pos;
+  while(pos.vis < n && pos.state.string[pos.state.pos_byte]) {
+    pos = split_read(pos, bytes);
+    if(pos.vis != end.vis) end = pos;
+  }
+  end.state.warn = pos.state.warn;  // avoid double warning
+  return end;
+}
+/*
+ * Consume any zero width sequences ahead of the next visible unit
+ */
+static struct split_pos split_skip(struct split_pos pos, int bytes) {
+  while(pos.state.string[pos.state.pos_byte]) {
+    struct split_pos next = split_read(pos, bytes);
+    if(next.vis != pos.vis) {
+      pos.state.warn = next.state.warn;  // avoid double warning
+      break;
+    }
+    pos = next;
+  }
+  return pos;
+}
+/*
+ * Write a piece spanning from `start` to `end`
+ */
+static SEXP split_write(
+  struct FANSI_state start, struct FANSI_state end, struct FANSI_buff * buff
+) {
+  int start_size = FANSI_state_size(start);
+  int needs_close = FANSI_state_has_style(end);
+  size_t size = (size_t) (end.pos_byte - start.pos_byte);
+
+  // Pieces can't be longer than their parent, so only the SGR additions can
+  // cause an overflow.
+
+  if(size > (size_t) (FANSI_int_max - start_size - 4))
+    error(
+      "%s%s",
+      "Attempting to create string longer than INT_MAX while adding leading ",
+      "and trailing CSI SGR sequences to a split piece."
+    );
+  size += start_size + (needs_close ? 4 : 0);
+  FANSI_size_buff(buff, size + 1);
 
+  char * buff_track = buff->buff;
+  if(start_size) {
+    FANSI_csi_write(buff_track, start, start_size);
+    buff_track += start_size;
+  }
+  memcpy(
+    buff_track, start.string + start.pos_byte, end.pos_byte - start.pos_byte
+  );
+  buff_track += end.pos_byte - start.pos_byte;
+  if(needs_close) {
+    memcpy(buff_track, "\033[0m", 4);
+    buff_track += 4;
+  }
+  *buff_track = 0;
+  FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+  return mkCharLenCE(
+    buff->buff, (int) size, end.has_utf8 ? CE_UTF8 : CE_NATIVE
+  );
+}
+/*
+ * Split one element
+ *
+ * @param starts, lens, m_len match starting positions (1 based) and lengths as
+ *   produced by `gregexpr`, `m_len` is zero if there are no matches.
+ * @param read_all whether to read through to the end of the string even if
+ *   there is nothing left to split, e.g. to compute the end state for `carry`.
+ * @param state_end set to the state after the last byte read.
+ */
+static SEXP split_chr(
+  struct FANSI_state state, const int * starts, const int * lens,
+  R_xlen_t m_len, int bytes, struct FANSI_buff * buff,
+  int read_all, struct FANSI_state * state_end
+) {
+  R_xlen_t pieces = m_len + 1;
+  SEXP res = PROTECT(allocVector(STRSXP, pieces));
+  struct split_pos pos = {.state = state, .vis = 0};
+  R_xlen_t k;
+
+  for(k = 0; k < pieces; ++k) {
+    int start = k ? starts[k - 1] + lens[k - 1] : 1;
+    int stop = k < m_len ? starts[k] - 1 : FANSI_int_max;
+
+    pos = split_to(pos, start - 1, bytes);
+    pos = split_skip(pos, bytes);
+
+    // Matches that run to the end of the string leave nothing after them
+    if(k && !pos.state.string[pos.state.pos_byte]) break;
+
+    if(stop < start) {
+      SET_STRING_ELT(res, k, R_BlankString);
+    } else {
+      struct FANSI_state state_start = pos.state;
+      pos = split_to(pos, stop, bytes);
+      SET_STRING_ELT(res, k, split_write(state_start, pos.state, buff));
+    }
+  }
+  state = pos.state;
+  if(read_all)
+    while(state.string[state.pos_byte]) state = FANSI_read_next(state);
+  *state_end = state;
+  if(k < pieces) res = xlengthgets(res, k);
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * @param x a character vector, already in UTF-8
+ * @param matches a list of the same length as `x` with the `gregexpr` results
+ *   for each element, or NULL for elements that should not be split.
+ * @param carry whether the SGR state at the end of each element should carry
+ *   over to the beginning of the next one.
+ */
+SEXP FANSI_strsplit(
+  SEXP x, SEXP matches, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry
+) {
   if(
-    TYPEOF(x) != VECSXP || TYPEOF(warn) != LGLSXP ||
-    TYPEOF(term_cap) != INTSXP
+    TYPEOF(x) != STRSXP || TYPEOF(matches) != VECSXP ||
+    TYPEOF(warn) != LGLSXP || TYPEOF(term_cap) != INTSXP ||
+    TYPEOF(ctl) != INTSXP || TYPEOF(carry) != LGLSXP ||
+    XLENGTH(x) != XLENGTH(matches)
   )
-    error("Internal Error: invalid arguments; contact maintainer.");
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
 
-  R_xlen_t x_len = xlength(x);
+  R_xlen_t x_len = XLENGTH(x);
+  int carry_int = asLogical(carry);
+  int warned = 0;
 
-  // Save two spots on protect stack, one for the VECSXP, and then one for each
-  // STRSXP we need to create
+  SEXP sym_len = install("match.length");
+  SEXP sym_bytes = install("useBytes");
 
-  PROTECT_INDEX ipx;
-  PROTECT_WITH_INDEX(x, &ipx);
+  SEXP res = PROTECT(allocVector(VECSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+  struct FANSI_opts opts = FANSI_opts_sxp(warn, term_cap, ctl);
+  struct FANSI_state state_carry = FANSI_state_init_opts("", opts, 1, 1, 0);
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) {
+      SET_VECTOR_ELT(res, i, ScalarString(NA_STRING));
+      continue;
+    }
+    FANSI_check_chrsxp(chr, i);
 
-  SEXP res_vec = x;
+    SEXP match = VECTOR_ELT(matches, i);
+    const int * starts = NULL, * lens = NULL;
+    R_xlen_t m_len = 0;
+    int bytes = 0;
 
-  int sgr_in_vec, sgr_in_str;
-  sgr_in_vec = sgr_in_str = 0;
-  struct FANSI_buff buff = {.len=0};
-  char * buff_track = buff.buff;
+    if(match != R_NilValue) {
+      SEXP match_len = getAttrib(match, sym_len);
+      if(
+        TYPEOF(match) != INTSXP || TYPEOF(match_len) != INTSXP ||
+        XLENGTH(match) != XLENGTH(match_len)
+      )
+        error("Internal Error: bad match data; contact maintainer."); // nocov
 
-  for(R_xlen_t i = 0; i < x_len; ++i) {
+      starts = INTEGER(match);
+      lens = INTEGER(match_len);
+      m_len = XLENGTH(match);
+      if(m_len == 1 && starts[0] < 1) m_len = 0;  // no match
+      bytes = asLogical(getAttrib(match, sym_bytes)) == 1;
+    }
+    struct FANSI_state state = FANSI_state_init_opts(CHAR(chr), opts, 1, 1, 0);
+    if(warned) state.warn = -state.warn;
 
-    sgr_in_str = 0;
+    if(!m_len && !carry_int) {
+      // Unsplit elements are returned as is, but still need to be read for
+      // warnings if nothing has warned yet.
+      if(state.warn > 0) {
+        while(state.string[state.pos_byte]) state = FANSI_read_next(state);
+        warned = state.warn < 0;
+      }
+      SET_VECTOR_ELT(res, i, ScalarString(chr));
+      continue;
+    }
+    if(carry_int) state = FANSI_state_copy_style(state, state_carry);
 
-    FANSI_interrupt(i);
-    SEXP string = VECTOR_ELT(x, i);
-    if(TYPEOF(string) != STRSXP)
-      // nocov start
-      error(
-        "%s%s%s",
-        "Internal Error: result of `strsplit` contains ",
-        type2char(TYPEOF(string)),
-        " instead of expected STRSXP; contact maintainer."
-      );
-      // nocov end
+    struct FANSI_state state_end;
+    SEXP res_i = PROTECT(
+      split_chr(
+        state, starts, lens, m_len, bytes, &buff, carry_int, &state_end
+    ) );
+    SET_VECTOR_ELT(res, i, res_i);
+    UNPROTECT(1);
+
+    warned = warned || state_end.warn < 0;
+    if(carry_int) state_carry = state_end;
+  }
+  UNPROTECT(1);
+  return res;
+}
+/*
+ * Write a line, with the SGR state active at its start and a closing SGR if
+ * there is any state active at its end
+ */
+static SEXP line_write(
+  struct FANSI_state start, struct FANSI_state end,
+  const char * line, int line_len, cetype_t enc, struct FANSI_buff * buff
+) {
+  int start_size = FANSI_state_size(start);
+  int needs_close = FANSI_state_has_style(end);
+  if(!line_len) return R_BlankString;
+  if(!start_size && !needs_close) return mkCharLenCE(line, line_len, enc);
+
+  if(line_len > FANSI_int_max - start_size - 4)
+    error(
+      "%s%s",
+      "Attempting to create string longer than INT_MAX while adding leading ",
+      "and trailing CSI SGR sequences to a line."
+    );
+  int size = line_len + start_size + (needs_close ? 4 : 0);
+  FANSI_size_buff(buff, (size_t) size + 1);
+
+  char * buff_track = buff->buff;
+  if(start_size) {
+    FANSI_csi_write(buff_track, start, start_size);
+    buff_track += start_size;
+  }
+  memcpy(buff_track, line, line_len);
+  buff_track += line_len;
+  if(needs_close) {
+    memcpy(buff_track, "\033[0m", 4);
+    buff_track += 4;
+  }
+  *buff_track = 0;
+  FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+  return mkCharLenCE(buff->buff, size, enc);
+}
+/*
+ * Split strings on newlines
+ *
+ * Newlines are found with `memchr`, which C libraries typically vectorize, and
+ * only the escape sequences within each line are parsed to track the SGR
+ * state.  Like `strsplit`, a trailing newline does not start a new line.
+ *
+ * @param x a character vector, already in UTF-8
+ * @param carry whether the SGR state at the end of each element should carry
+ *   over to the beginning of the next one.
+ */
+SEXP FANSI_split_lines(
+  SEXP x, SEXP warn, SEXP term_cap, SEXP ctl, SEXP carry
+) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(warn) != LGLSXP ||
+    TYPEOF(term_cap) != INTSXP || TYPEOF(ctl) != INTSXP ||
+    TYPEOF(carry) != LGLSXP
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  int carry_int = asLogical(carry);
+
+  SEXP R_true = PROTECT(ScalarLogical(1));
+  SEXP R_zero = PROTECT(ScalarInteger(0));
+  struct FANSI_state state_blank = FANSI_state_init_full(
+    "", warn, term_cap, R_true, R_true, R_zero, ctl
+  );
+  struct FANSI_state state = state_blank;
+  int sgr = state.ctl & FANSI_CTL_SGR;
 
-    R_xlen_t chr_len = XLENGTH(string);
-    struct FANSI_state state_prev = FANSI_state_init("", warn, term_cap);
+  SEXP res = PROTECT(allocVector(VECSXP, x_len));
+  struct FANSI_buff buff = {.len = 0};
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) {
+      SET_VECTOR_ELT(res, i, ScalarString(NA_STRING));
+      continue;
+    }
+    FANSI_check_chrsxp(chr, i);
 
-    for(R_xlen_t j = 0; j < chr_len; ++j) {
+    const char * string = CHAR(chr);
+    const char * end = string + LENGTH(chr);
+    const char * line, * nl;
+    cetype_t enc = getCharCE(chr);
 
-      FANSI_interrupt(j);
+    // Count the lines first so we can size the result
 
-      SEXP chrsxp = STRING_ELT(string, j);
-      FANSI_check_chrsxp(chrsxp, j);
+    R_xlen_t lines = 0;
+    for(line = string; line < end; line = nl + 1) {
+      ++lines;
+      if(!(nl = memchr(line, '\n', end - line))) break;
+    }
+    SEXP res_i = PROTECT(allocVector(STRSXP, lines));
 
-      if(chrsxp != NA_STRING) {
-        const char * chr = CHAR(chrsxp);
-        R_len_t chr_len = LENGTH(chrsxp);
-        const char * chr_track = chr;
+    // Keep the warning status, but reset the style unless we carry it
 
-        struct FANSI_state state = FANSI_state_init(chr, warn, term_cap);
+    if(!carry_int) state = FANSI_state_copy_style(state, state_blank);
+    state = FANSI_reset_pos(state);
+    state.string = string;
 
-        // Read all escapes; note we only care about the state at the end of a
-        // string
+    line = string;
+    for(R_xlen_t j = 0; j < lines; ++j) {
+      nl = memchr(line, '\n', end - line);
+      const char * line_end = nl ? nl : end;
+      struct FANSI_state state_start = state;
 
-        while(*chr_track && (chr_track = strchr(chr_track, 0x1b))) {
-          state.pos_byte = (chr_track - chr);
+      if(sgr) {
+        // An escape sequence could have run past the previous newline
+        const char * esc = string + state.pos_byte;
+        if(esc < line) esc = line;
+        while(
+          esc < line_end && (esc = memchr(esc, 0x1b, line_end - esc))
+        ) {
+          state.pos_byte = (int) (esc - string);
           state = FANSI_read_next(state);
-          chr_track = chr + state.pos_byte;
+          esc = string + state.pos_byte;
         }
-        int has = FANSI_state_has_style(state);
-        int has_prev = FANSI_state_has_style(state_prev);
-        int chr_size = 0;
-        int chr_size_prev = 0;
+      }
+      SET_STRING_ELT(
+        res_i, j,
+        line_write(
+          state_start, state, line, (int) (line_end - line), enc, &buff
+      ) );
+      line = line_end + 1;
+    }
+    SET_VECTOR_ELT(res, i, res_i);
+    UNPROTECT(1);
+  }
+  UNPROTECT(3);
+  return res;
+}
+/*
+ * Map match offsets onto one element
+ *
+ * Matches must be sorted and not overlap, as they are from `regexpr` and
+ * `gregexpr`.  Outputs are 1 based, and include any escape sequences between
+ * the first and last matched characters, but not those before or after them.
+ */
+static void match_map(
+  struct FANSI_state state, const int * starts, const int * lens,
+  R_xlen_t m_len, int bytes,
+  int * w_start, int * w_len, int * b_start, int * b_len
+) {
+  struct split_pos pos = {.state = state, .vis = 0};
+  for(R_xlen_t k = 0; k < m_len; ++k) {
+    if(starts[k] == NA_INTEGER || starts[k] < 1) {
+      w_start[k] = w_len[k] = b_start[k] = b_len[k] = starts[k];
+      continue;
+    }
+    pos = split_to(pos, starts[k] - 1, bytes);
+    pos = split_skip(pos, bytes);
+    struct FANSI_state start = pos.state;
+    pos = split_to(pos, starts[k] - 1 + lens[k], bytes);
 
-        if(has_prev) {
-          chr_size = chr_size_prev = FANSI_state_size(state_prev);
-        }
-        if(has_prev || has) {
-          // really shouldn't overflow
-          chr_size = FANSI_ADD_INT(chr_size, 4);
-
-          if(chr_len > FANSI_int_max - chr_size) {
-            error(
-              "%s%s",
-              "Overflow while attempting to reformat styles on split string; ",
-              "this can happen if you have a sub-string close to INT_MAX long ",
-              "and adding initial / and or ending SGRs would push it over ",
-              "INT_MAX."
-            );
-          }
-          chr_size += chr_len;
-          FANSI_size_buff(&buff, (size_t) chr_size + 1); // + 1 for the NULL
-          buff_track = buff.buff;
-
-          if(!sgr_in_vec) {
-            // re-allocate VECSXP
-            sgr_in_vec = 1;
-            REPROTECT(res_vec = duplicate(x), ipx);
-            // Initiate buffer
-          }
-          if(!sgr_in_str) {
-            // re-allocate STRSXP
-            sgr_in_str = 1;
-            SEXP string_cpy = PROTECT(duplicate(string));
-            SET_VECTOR_ELT(res_vec, i, string_cpy);
-            UNPROTECT(1);
-            string = string_cpy;
-          }
-          if(has_prev) {
-            FANSI_csi_write(buff_track, state_prev, chr_size_prev);
-            buff_track += chr_size_prev;
-          }
-          memcpy(buff_track, chr, chr_len);
-          buff_track += chr_len;
-          memcpy(buff_track, "\033[0m", 4);
-          buff_track += 4;
-          *buff_track = 0;  // not strictly necessary
-
-          SEXP chrsxp_new =
-            PROTECT(mkCharLenCE(buff.buff, chr_size, getCharCE(chrsxp)));
-
-          SET_STRING_ELT(string, j, chrsxp_new);
-          UNPROTECT(1);
-
-          if(has) state_prev = state;
-  } } } }
-  UNPROTECT(1);
-  return res_vec;
+    w_start[k] = start.pos_width + 1;
+    b_start[k] = start.pos_byte + 1;
+    if(pos.state.pos_byte > start.pos_byte) {
+      w_len[k] = pos.state.pos_width - start.pos_width;
+      b_len[k] = pos.state.pos_byte - start.pos_byte;
+    } else w_len[k] = b_len[k] = 0;  // zero length match
+  }
+}
+static SEXP match_attrs(
+  SEXP res, SEXP w_start, SEXP w_len, SEXP b_start, SEXP b_len
+) {
+  setAttrib(res, install("width.start"), w_start);
+  setAttrib(res, install("width.length"), w_len);
+  setAttrib(res, install("byte.start"), b_start);
+  setAttrib(res, install("byte.length"), b_len);
+  return res;
+}
+/*
+ * Add width and original byte offsets to `regexpr` / `gregexpr` results
+ *
+ * @param x a character vector, already in UTF-8, that had its Control
+ *   Sequences stripped before being matched.
+ * @param matches the result of `regexpr` (INTSXP) or `gregexpr` (VECSXP) on
+ *   the stripped version of `x`.
+ * @return `matches` with additional "width.start", "width.length",
+ *   "byte.start", and "byte.length" attributes for each match.
+ */
+SEXP FANSI_match_map(SEXP x, SEXP matches, SEXP ctl) {
+  if(
+    TYPEOF(x) != STRSXP || TYPEOF(ctl) != INTSXP ||
+    (TYPEOF(matches) != INTSXP && TYPEOF(matches) != VECSXP) ||
+    XLENGTH(x) != XLENGTH(matches)
+  )
+    error("Internal Error: invalid arguments; contact maintainer."); // nocov
+
+  R_xlen_t x_len = XLENGTH(x);
+  int greg = TYPEOF(matches) == VECSXP;
+
+  // Positions are only mapped, warnings are issued when stripping
+
+  SEXP R_false = PROTECT(ScalarLogical(0));
+  SEXP term_cap = PROTECT(allocVector(INTSXP, 3));
+  for(int i = 0; i < 3; ++i) INTEGER(term_cap)[i] = i + 1;
+  struct FANSI_opts opts = FANSI_opts_sxp(R_false, term_cap, ctl);
+
+  SEXP sym_len = install("match.length");
+  SEXP sym_bytes = install("useBytes");
+  SEXP res, w_start, w_len, b_start, b_len;
+  int bytes = 0;
+
+  if(greg) {
+    res = PROTECT(allocVector(VECSXP, x_len));
+    w_start = w_len = b_start = b_len = R_NilValue;
+  } else {
+    res = PROTECT(shallow_duplicate(matches));
+    w_start = PROTECT(allocVector(INTSXP, x_len));
+    w_len = PROTECT(allocVector(INTSXP, x_len));
+    b_start = PROTECT(allocVector(INTSXP, x_len));
+    b_len = PROTECT(allocVector(INTSXP, x_len));
+    bytes = asLogical(getAttrib(matches, sym_bytes)) == 1;
+  }
+  SEXP match_len_all = greg ? R_NilValue : getAttrib(matches, sym_len);
+  if(!greg && XLENGTH(match_len_all) != x_len)
+    error("Internal Error: bad match data; contact maintainer."); // nocov
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    SEXP match = greg ? VECTOR_ELT(matches, i) : matches;
+    SEXP match_len = greg ? getAttrib(match, sym_len) : match_len_all;
+    if(
+      TYPEOF(match) != INTSXP || TYPEOF(match_len) != INTSXP ||
+      XLENGTH(match) != XLENGTH(match_len)
+    )
+      error("Internal Error: bad match data; contact maintainer."); // nocov
+
+    R_xlen_t m_len = greg ? XLENGTH(match) : 1;
+    R_xlen_t off = greg ? 0 : i;
+
+    if(greg) {
+      SEXP res_i = PROTECT(shallow_duplicate(match));
+      SET_VECTOR_ELT(res, i, res_i);
+      w_start = PROTECT(allocVector(INTSXP, m_len));
+      w_len = PROTECT(allocVector(INTSXP, m_len));
+      b_start = PROTECT(allocVector(INTSXP, m_len));
+      b_len = PROTECT(allocVector(INTSXP, m_len));
+      match_attrs(res_i, w_start, w_len, b_start, b_len);
+      UNPROTECT(5);
+      bytes = asLogical(getAttrib(match, sym_bytes)) == 1;
+    }
+    const char * string = "";
+    if(chr != NA_STRING) {
+      FANSI_check_chrsxp(chr, i);
+      string = CHAR(chr);
+    }
+    struct FANSI_state state = FANSI_state_init_opts(string, opts, 1, 1, 1);
+    match_map(
+      state, INTEGER(match) + off, INTEGER(match_len) + off, m_len, bytes,
+      INTEGER(w_start) + off, INTEGER(w_len) + off,
+      INTEGER(b_start) + off, INTEGER(b_len) + off
+    );
+  }
+  if(!greg) {
+    match_attrs(res, w_start, w_len, b_start, b_len);
+    UNPROTECT(4);
+  }
+  UNPROTECT(3);
+  return res;
 }
-// nocov end
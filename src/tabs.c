@@ -62,6 +62,7 @@ SEXP FANSI_tabs_as_spaces(
 
   PROTECT_INDEX ipx;
   PROTECT_WITH_INDEX(res_sxp, &ipx);  // reserve spot if we need to alloc later
+  struct FANSI_opts opts = FANSI_opts_sxp(warn, term_cap, ctl);
 
   for(R_xlen_t i = 0; i < len; ++i) {
     FANSI_interrupt(i);
@@ -109,12 +110,7 @@ SEXP FANSI_tabs_as_spaces(
 
       FANSI_size_buff(buff, new_buff_size);
 
-      SEXP R_true = PROTECT(ScalarLogical(1));
-      SEXP R_one = PROTECT(ScalarInteger(1));
-      struct FANSI_state state = FANSI_state_init_full(
-        string, warn, term_cap, R_true, R_true, R_one, ctl
-      );
-      UNPROTECT(2);
+      struct FANSI_state state = FANSI_state_init_opts(string, opts, 1, 1, 1);
 
       char cur_chr;
 
@@ -166,6 +162,7 @@ SEXP FANSI_tabs_as_spaces(
       cetype_t chr_type = CE_NATIVE;
       if(state.has_utf8) chr_type = CE_UTF8;
       FANSI_check_chr_size(buff_start, buff_track, i);
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
       SEXP chr_sxp = PROTECT(
         mkCharLenCE(buff_start, (int) (buff_track - buff_start), chr_type)
       );
@@ -176,11 +173,24 @@ SEXP FANSI_tabs_as_spaces(
   UNPROTECT(1);
   return res_sxp;
 }
+struct tabs_call {
+  SEXP vec, tab_stops, warn, term_cap, ctl;
+  struct FANSI_buff buff;
+};
+static SEXP tabs_as_spaces(void * data) {
+  struct tabs_call * call = (struct tabs_call *) data;
+  return FANSI_tabs_as_spaces(
+    call->vec, call->tab_stops, &call->buff, call->warn, call->term_cap,
+    call->ctl
+  );
+}
 SEXP FANSI_tabs_as_spaces_ext(
   SEXP vec, SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl
 ) {
-  struct FANSI_buff buff = {.len = 0};
-
-  return FANSI_tabs_as_spaces(vec, tab_stops, &buff, warn, term_cap, ctl);
+  struct tabs_call call = {
+    .vec=vec, .tab_stops=tab_stops, .warn=warn, .term_cap=term_cap, .ctl=ctl,
+    .buff={.len = 0}
+  };
+  return FANSI_with_buff(tabs_as_spaces, &call, &call.buff);
 }
 
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2021  Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses/GPL-2> for a copy of the license.
+ */
+
+#include "fansi.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Multi-threading support
+ *
+ * Only ever used for element-wise work that does not touch the R API.  The
+ * main thread collects the `CHAR` pointers and lengths up front and then
+ * workers read from those, writing their results into arrays / buffers that
+ * were also allocated on the main thread.  Anything that requires the R API,
+ * including creating CHARSXPs and issuing warnings, is left to the main thread
+ * after the workers are done.
+ *
+ * Threading is opt-in via `getOption('fansi.threads')`, and we don't bother
+ * for inputs smaller than FANSI_PAR_MIN_BYTES as the overhead of starting the
+ * threads would dominate.
+ */
+
+#define FANSI_PAR_MIN_BYTES 65536
+
+/*
+ * How many threads we are allowed to use
+ *
+ * Always 1 if we were not compiled with OpenMP support, although we still
+ * validate the option so bad values are reported consistently.
+ */
+
+int FANSI_threads() {
+  int threads = 1;
+  SEXP opt = GetOption1(FANSI_threads_sym);
+  if(opt != R_NilValue) {
+    if(
+      (TYPEOF(opt) != INTSXP && TYPEOF(opt) != REALSXP) ||
+      XLENGTH(opt) != 1 || (threads = asInteger(opt)) == NA_INTEGER ||
+      threads < 1
+    )
+      error("Option `fansi.threads` must be a positive scalar integer.");
+  }
+#ifdef _OPENMP
+  int procs = omp_get_num_procs();
+  if(threads > procs) threads = procs;
+#else
+  threads = 1;
+#endif
+  return threads;
+}
+/*
+ * Collect the data workers need and decide how to split the work
+ *
+ * Elements are assigned to threads in contiguous chunks of roughly equal
+ * cumulative byte count so that a few very long strings don't all end up in
+ * the same thread.
+ *
+ * @param x a character vector, every element of which is checked with
+ *   `FANSI_check_chrsxp`.
+ * @param threads the number of threads to split the work across, typically the
+ *   return value of `FANSI_threads`.
+ * @return a struct describing the work split.  If `threads` is 1 in the return
+ *   value then the input is not worth parallelizing and the caller should use
+ *   its serial implementation; in that case the other members are not set.
+ */
+
+struct FANSI_par FANSI_par_init(SEXP x, int threads) {
+  R_xlen_t len = XLENGTH(x);
+  struct FANSI_par par = {.threads=1};
+
+  if(threads < 2 || len < threads) return par;
+
+  size_t total = 0;
+  for(R_xlen_t i = 0; i < len; ++i) total += (size_t) LENGTH(STRING_ELT(x, i));
+  if(total < FANSI_PAR_MIN_BYTES) return par;
+
+  par.len = len;
+  par.total = total;
+  par.threads = threads;
+  par.chrs = (const char **) R_alloc(len, sizeof(const char *));
+  par.lens = (int *) R_alloc(len, sizeof(int));
+  par.offs = (size_t *) R_alloc(len + 1, sizeof(size_t));
+  par.bounds = (R_xlen_t *) R_alloc(threads + 1, sizeof(R_xlen_t));
+
+  size_t off = 0;
+  int chunk = 1;
+  par.bounds[0] = 0;
+
+  for(R_xlen_t i = 0; i < len; ++i) {
+    FANSI_interrupt(i);
+    SEXP chrsxp = STRING_ELT(x, i);
+    if(chrsxp == NA_STRING) {
+      par.chrs[i] = NULL;
+      par.lens[i] = 0;
+    } else {
+      FANSI_check_chrsxp(chrsxp, i);
+      par.chrs[i] = CHAR(chrsxp);
+      par.lens[i] = LENGTH(chrsxp);
+    }
+    // Start a new chunk once we've crossed the byte threshold for it
+
+    while(chunk < threads && off >= total / threads * chunk)
+      par.bounds[chunk++] = i;
+
+    par.offs[i] = off;
+    off += (size_t) par.lens[i];
+  }
+  par.offs[len] = off;
+  while(chunk <= threads) par.bounds[chunk++] = len;
+
+  return par;
+}
@@ -129,13 +129,28 @@ static int color_to_8bit(int color, int* color_extra) {
  */
 
 static const char * get_color_class(
-  int color, int* color_extra, SEXP color_classes, int bg
+  int color, int* color_extra, const char ** color_classes, int bg
 ) {
   int col8bit = color_to_8bit(color, color_extra);
-  if(col8bit >= 0 && XLENGTH(color_classes) / 2 > (R_xlen_t) col8bit)
-    return CHAR(STRING_ELT(color_classes, col8bit * 2 + bg));
+  if(col8bit >= 0) return color_classes[col8bit * 2 + bg];
   else return NULL;
 }
+/*
+ * Retrieve the color classes from the user provided vector
+ *
+ * We do this ahead of time so the HTML generation does not need to touch the
+ * R API.
+ *
+ * @return a 512 long array with the foreground and background classes for each
+ *   of the 256 8 bit colors, with NULL for those without a class.
+ */
+static const char ** get_color_classes(SEXP color_classes) {
+  const char ** res = (const char **) R_alloc(512, sizeof(const char *));
+  R_xlen_t class_n = XLENGTH(color_classes) / 2 * 2;
+  for(R_xlen_t i = 0; i < 512; ++i)
+    res[i] = i < class_n ? CHAR(STRING_ELT(color_classes, i)) : NULL;
+  return res;
+}
 /*
  * All color conversions taken from
  *
@@ -264,6 +279,46 @@ static void overflow_err2(R_xlen_t i) {
     "INT_MAX", "at position", FANSI_ind(i), ". Try again with smaller strings."
   );
 }
+/*
+ * Worker threads cannot raise R errors, so the HTML functions they use record
+ * one of these codes instead and `html_raise` signals it on the main thread.
+ */
+enum html_err {
+  HTML_OK = 0,
+  HTML_ERR_INT_MAX,
+  HTML_ERR_SIZE_MAX,
+  HTML_ERR_LEN_T_MAX,
+  HTML_ERR_NEG,
+  HTML_ERR_BUFF
+};
+static void html_raise(int err, R_xlen_t i) {
+  switch(err) {
+    case HTML_OK: break;
+    case HTML_ERR_INT_MAX: overflow_err("INT_MAX", i); break;
+    case HTML_ERR_SIZE_MAX: overflow_err("SIZE_MAX", i); break;       // nocov
+    case HTML_ERR_LEN_T_MAX: overflow_err("R_LEN_T_MAX", i); break;   // nocov
+    // nocov start
+    case HTML_ERR_NEG:
+      error(
+        "%s%s",
+        "Internal Error: CSS would translate to negative length string; ",
+        "this should not happen."
+      );
+    case HTML_ERR_BUFF:
+      error("Internal Error: buffer length mismatch in html generation.");
+    default:
+      error("Internal Error: unknown html error code %d.", err);
+    // nocov end
+  }
+}
+/*
+ * Raise `code` directly if `err` is NULL, else record it in `err` unless an
+ * earlier error is already recorded there.
+ */
+static void html_fail(int code, R_xlen_t i, int * err) {
+  if(!err) html_raise(code, i);
+  else if(!*err) *err = code;
+}
 /*
  * If *buff is not NULL, copy tmp into it and advance, else measure tmp
  * and advance length
@@ -276,14 +331,18 @@ static void overflow_err2(R_xlen_t i) {
  * the end of what is written to so string is ready to append to.
  *
  * @param i index in overal character vector, needed to report overflow string.
+ * @param err NULL, or where to record errors (see `html_fail`).
  */
 static unsigned int copy_or_measure(
-  char ** buff, const char * tmp, unsigned int len, R_xlen_t i
+  char ** buff, const char * tmp, unsigned int len, R_xlen_t i, int * err
 ) {
   size_t tmp_len = strlen(tmp);
   // strictly it's possible for len > FANSI_int_max, but shouldn't happen even
   // in testing since we only grow len by first checking.
-  if(tmp_len > FANSI_int_max - len) overflow_err("INT_MAX", i);
+  if(tmp_len > FANSI_int_max - len) {
+    html_fail(HTML_ERR_INT_MAX, i, err);
+    return 0;
+  }
   if(*buff) {
     strcpy(*buff, tmp);
     *buff += tmp_len;
@@ -303,13 +362,14 @@ static unsigned int copy_or_measure(
  *
  * @param buff the buffer to write to, if it is null only computes size instead
  *   also of writing.
+ * @param err NULL, or where to record errors (see `html_fail`).
  */
 static int state_size_and_write_as_html(
   struct FANSI_state state,
   struct FANSI_state state_prev,
   char * buff,
-  SEXP color_classes, R_xlen_t i,
-  int bytes_html
+  const char ** color_classes, R_xlen_t i,
+  int bytes_html, int * err
 ) {
   /****************************************************\
   | IMPORTANT: KEEP THIS ALIGNED WITH FANSI_csi_write  |
@@ -328,12 +388,12 @@ static int state_size_and_write_as_html(
 
   if(state_change) {
     if(!has_cur_state) {
-      len += copy_or_measure(&buff, "</span>", len, i);
+      len += copy_or_measure(&buff, "</span>", len, i, err);
     } else {
       if (!has_prev_state) {
-        len += copy_or_measure(&buff, "<span", len, i);
+        len += copy_or_measure(&buff, "<span", len, i, err);
       } else {
-        len += copy_or_measure(&buff, "</span><span", len, i);
+        len += copy_or_measure(&buff, "</span><span", len, i, err);
       }
       // Styles
       int invert = state.style & (1 << 7);
@@ -352,11 +412,12 @@ static int state_size_and_write_as_html(
       // Brights remapped to 8-15
 
       if(color_class || bgcol_class) {
-        len += copy_or_measure(&buff, " class='", len, i);
-        if(color_class) len += copy_or_measure(&buff, color_class, len, i);
-        if(color_class && bgcol_class) len += copy_or_measure(&buff, " ", len, i);
-        if(bgcol_class) len += copy_or_measure(&buff, bgcol_class, len, i);
-        len += copy_or_measure(&buff, "'", len, i);
+        len += copy_or_measure(&buff, " class='", len, i, err);
+        if(color_class) len += copy_or_measure(&buff, color_class, len, i, err);
+        if(color_class && bgcol_class)
+          len += copy_or_measure(&buff, " ", len, i, err);
+        if(bgcol_class) len += copy_or_measure(&buff, bgcol_class, len, i, err);
+        len += copy_or_measure(&buff, "'", len, i, err);
       }
       // inline style and/or colors
       if(
@@ -364,43 +425,40 @@ static int state_size_and_write_as_html(
         (color >= 0 && (!color_class)) ||
         (bg_color >= 0 && (!bgcol_class))
       ) {
-        len += copy_or_measure(&buff, " style='", len, i);
+        len += copy_or_measure(&buff, " style='", len, i, err);
         unsigned int len_start = len;
         char color_tmp[8];
         if(color >= 0 && (!color_class)) {
-          len += copy_or_measure(&buff, "color: ", len, i);
+          len += copy_or_measure(&buff, "color: ", len, i, err);
           len += copy_or_measure(
-            &buff, color_to_html(color, color_extra, color_tmp), len, i
+            &buff, color_to_html(color, color_extra, color_tmp), len, i, err
           );
         }
         if(bg_color >= 0 && (!bgcol_class)) {
-          if(len_start < len) len += copy_or_measure(&buff, "; ", len, i);
-          len += copy_or_measure(&buff,  "background-color: ", len, i);
+          if(len_start < len) len += copy_or_measure(&buff, "; ", len, i, err);
+          len += copy_or_measure(&buff,  "background-color: ", len, i, err);
           len += copy_or_measure(
-            &buff, color_to_html(bg_color, bg_color_extra, color_tmp), len, i
+            &buff, color_to_html(bg_color, bg_color_extra, color_tmp), len,
+            i, err
           );
         }
         // Styles (need to go after color for transparent to work)
-        for(int i = 1; i < 10; ++i)
-          if(state.style & css_html_mask & (1 << i)) {
-            if(len_start < len) len += copy_or_measure(&buff, "; ", len, i);
-            len += copy_or_measure(&buff, css_style[i - 1].css, len, i);
+        for(int j = 1; j < 10; ++j)
+          if(state.style & css_html_mask & (1 << j)) {
+            if(len_start < len)
+              len += copy_or_measure(&buff, "; ", len, i, err);
+            len += copy_or_measure(&buff, css_style[j - 1].css, len, i, err);
           }
 
-        len += copy_or_measure(&buff, ";'", len, i);
+        len += copy_or_measure(&buff, ";'", len, i, err);
       }
-      len += copy_or_measure(&buff, ">", len, i);
+      len += copy_or_measure(&buff, ">", len, i, err);
   } }
   len -= bytes_html;
   if(buff) {
     *buff = 0;
     if((unsigned int)(buff - buff_start) != len)
-      // nocov start
-      error(
-        "Internal Error: buffer length mismatch in html generation (%ud vs %ud).",
-        len, (unsigned int)(buff - buff_start)
-      );
-      // nocov end
+      html_fail(HTML_ERR_BUFF, i, err);  // nocov
   }
   // We've checked len at every step, so it cannot overflow INT_MAX.
 
@@ -410,14 +468,14 @@ static int state_size_and_write_as_html(
  * Final checks for unsual size, and include space for terminator.
  */
 
-static size_t final_string_size(int bytes, R_xlen_t i) {
+static size_t final_string_size(int bytes, R_xlen_t i, int * err) {
   // In the extremely unlikely case we're on a systems with weird integer sizes
   // or R changes what R_len_t.  >= SIZE_MAX b/c we need room for the extra NULL
   // terminator byte
   if(INT_MAX >= SIZE_MAX && (unsigned int) bytes >= SIZE_MAX)
-    overflow_err("SIZE_MAX", i);     // nocov
+    html_fail(HTML_ERR_SIZE_MAX, i, err);     // nocov
   if(INT_MAX > R_LEN_T_MAX && bytes > R_LEN_T_MAX)
-    overflow_err("R_LEN_T_MAX", i);  // nocov
+    html_fail(HTML_ERR_LEN_T_MAX, i, err);    // nocov
 
   return (size_t) bytes + 1;   // include terminator
 }
@@ -430,13 +488,18 @@ static size_t final_string_size(int bytes, R_xlen_t i) {
  * buffers of known length via mkCharLenCE or some such, but it feels
  * uncomfortable having an unterminated string floating around.
  *
- * @return the size of the string **including** the NULL terminator
+ * @param err NULL, or where to record errors (see `html_fail`).
+ * @return the size of the string **including** the NULL terminator, or zero
+ *   if an error was recorded in `err`.
  */
 static size_t html_check_overflow(
-  int bytes_html, int bytes_esc, int bytes_init, int span_extra, R_xlen_t i
+  int bytes_html, int bytes_esc, int bytes_init, int span_extra, R_xlen_t i,
+  int * err
 ) {
-  if(bytes_init < 0 || span_extra < 0)
-    error("Internal Error: illegal -ve lengths in overflow check."); // nocov
+  if(bytes_init < 0 || span_extra < 0) {
+    html_fail(HTML_ERR_NEG, i, err);  // nocov
+    return 0;                         // nocov
+  }
 
   // both bytes_html and byte_esc are positive, so this cannot overflow
 
@@ -451,33 +514,304 @@ static size_t html_check_overflow(
        bytes_extra < 0 &&
        bytes_init + bytes_extra > FANSI_int_max - span_extra
     )
-  ) overflow_err("INT_MAX", i);
-
+  ) {
+    html_fail(HTML_ERR_INT_MAX, i, err);
+    return 0;
+  }
   if(bytes_init + bytes_extra + span_extra < 0) {
+    html_fail(HTML_ERR_NEG, i, err);  // nocov
+    return 0;                         // nocov
+  }
+  int bytes_final = bytes_init + bytes_extra + span_extra;
+  size_t bytes_size = final_string_size(bytes_final, i, err);
+  return err && *err ? 0 : bytes_size;
+}
+
+/*
+ * Read an escape sequence
+ *
+ * Worker threads must not touch the R API, so they pass a `diag` to use the
+ * R-free `FANSI_read_next_core` and have problems recorded there instead.
+ * The HTML state is always read in "chars" mode so there are no widths to
+ * resolve.
+ */
+static struct FANSI_state html_read(
+  struct FANSI_state state, struct FANSI_diag * diag, R_xlen_t i
+) {
+  if(!diag) return FANSI_read_next(state);
+  state = FANSI_read_next_core(state);
+  FANSI_diag_add(diag, i, state);
+  return state;
+}
+/*
+ * Measure the HTML version of a string
+ *
+ * @param state the state at the beginning of the string, with the `string`
+ *   member set to the string and positions reset.
+ * @param state_init the blank state.
+ * @param bytes_init the length of the string.
+ * @param diag NULL, or where to record problems if called from a worker
+ *   thread (see `html_read`).
+ * @param err NULL, or where to record errors if called from a worker thread
+ *   (see `html_fail`).
+ * @return the required buffer size including the NULL terminator, or zero if
+ *   the string does not need to be re-written or an error was recorded in
+ *   `err`; also the state at the end of the string which is what the next
+ *   element should begin with.
+ */
+struct html_meas {
+  struct FANSI_state state;
+  size_t bytes;
+};
+static struct html_meas html_measure(
+  struct FANSI_state state, struct FANSI_state state_init, int bytes_init,
+  const char ** color_classes, R_xlen_t i, struct FANSI_diag * diag,
+  int * err
+) {
+  const char * string = state.string;
+  const char * span_end = "</span>";
+  int span_end_len = (int) strlen(span_end);
+  struct FANSI_state state_prev = state_init;
+
+  int bytes_html = 0;
+  int bytes_esc = 0;
+  size_t bytes_final = 0;
+
+  // Some ESCs may not produce any HTML, and some strings may gain HTML from
+  // an ESC from a prior element even if they have no ESCs.
+  int has_esc = 0;
+  int has_state = state_has_style_html(state);
+  int trail_span = 0;
+
+  // We cheat by only using `html_read` to read escape sequences as we
+  // don't care about display width, etc.  Normally we would _read_next over
+  // all characters, not just skip from ESC to ESC.
+
+  // Leftover from prior element (only if can't be merged with new)
+  if(*string && *string != 0x1b && state_has_style_html(state)) {
+    bytes_html += state_size_and_write_as_html(
+      state, state_prev,  NULL, color_classes, i, bytes_html, err
+    );
+    state_prev = state;
+  }
+  // New in this element
+  while(1) {
+    trail_span = state_has_style_html(state_prev);
+    string = strchr(string, 0x1b);
+    if(!string) string = state.string + bytes_init;
+    else {
+      has_esc = 1;
+      state.pos_byte = (string - state.string);
+    }
+    // State as html, skip if at end of string
+    if(*string) {
+      int esc_start = state.pos_byte;
+      state = html_read(state, diag, i);
+      string = state.string + state.pos_byte;
+      bytes_esc += state.pos_byte - esc_start;  // cannot overflow int
+      if(*string) {
+        bytes_html += state_size_and_write_as_html(
+          state, state_prev,  NULL, color_classes, i, bytes_html, err
+        );
+      }
+      state_prev = state;
+      has_state |= state_has_style_html(state);
+      if(!*string) break; // nothing after state, so done
+    } else break;
+  }
+  if(has_esc || has_state) {
+    bytes_final = html_check_overflow(
+      bytes_html, bytes_esc, bytes_init,
+      span_end_len * trail_span, // Last non-terminal state has style?
+      i, err
+    );
+  }
+  return (struct html_meas) {.state=state, .bytes=bytes_final};
+}
+/*
+ * Write the HTML version of a string
+ *
+ * Very similar to `html_measure`, but different enough it would be annoying
+ * to make a common function.
+ *
+ * @param buff must be at least as large as `html_measure` says it should be.
+ * @param diag as for `html_measure`.
+ * @param err as for `html_measure`.
+ * @return number of bytes written, excluding the NULL terminator, which the
+ *   caller should check with `html_check_len`.
+ */
+static int html_write(
+  struct FANSI_state state, struct FANSI_state state_init, int bytes_init,
+  const char ** color_classes, char * buff, R_xlen_t i,
+  struct FANSI_diag * diag, int * err
+) {
+  const char * string = state.string;  // always points to first byte
+  const char * span_end = "</span>";
+  int span_end_len = (int) strlen(span_end);
+  struct FANSI_state state_prev = state_init;
+  int trail_span = 0;
+
+  char * buff_track = buff;
+
+  if(*string && *string != 0x1b && state_has_style_html(state)) {
+    buff_track += state_size_and_write_as_html(
+      state, state_prev,  buff_track, color_classes, i, 0, err
+    );
+    state_prev = state;
+  }
+  while(1) {
+    const char * string_prev = string;
+    trail_span = state_has_style_html(state_prev);
+    string = strchr(string, 0x1b);
+    if(!string) string = state.string + bytes_init;
+    else state.pos_byte = (string - state.string);
+
+    // The text since the last ESC
+    int bytes_prev = string - string_prev;
+    memcpy(buff_track, string_prev, bytes_prev);
+    buff_track += bytes_prev;
+    state.pos_byte = (string - state.string);
+
+    // State as html, skip if at end of string
+    if(*string) {
+      state = html_read(state, diag, i);
+      string = state.string + state.pos_byte;
+      if(*string) {
+        buff_track += state_size_and_write_as_html(
+          state, state_prev,  buff_track, color_classes, i, 0, err
+        );
+      }
+      state_prev = state;
+      if(!*string) break; // nothing after state, so done
+    } else break;
+  }
+  // Trailing SPAN if needed
+  if(trail_span) {
+    memcpy(buff_track,span_end, span_end_len);
+    buff_track += span_end_len;
+  }
+  *(buff_track) = '0';  // not strictly needed
+
+  return (int)(buff_track - buff);
+}
+/*
+ * Check that `html_write` is in sync with `html_measure`
+ *
+ * @param bytes_final as returned by `html_measure` (includes the NULL).
+ */
+static void html_check_len(int bytes_out, size_t bytes_final) {
+  if(bytes_out != (int)(bytes_final - 1))
     // nocov start
     error(
-      "%s%s",
-      "Internal Error: CSS would translate to negative length string; ",
-      "this should not happen."
+      "Internal Error: %s (%d vs %zu).",
+      "buffer length mismatch in html generation (2)",
+      bytes_out, bytes_final - 1
     );
     // nocov end
+}
+/*
+ * Multi-threaded version of the FANSI_esc_to_html loop
+ *
+ * Uses the carry engine to figure out the starting state of each element, and
+ * then measures and writes each element independently into a buffer with room
+ * for all of them.  The carry pass reads every escape sequence so it already
+ * warned about any problems; the workers record theirs in per-thread `diag`s
+ * that are checked on the main thread only for fatal ones.  Likewise the
+ * workers record overflow and other errors as per-element codes that are
+ * raised on the main thread after each parallel region.
+ */
+static SEXP html_par(
+  SEXP x, struct FANSI_par par, struct FANSI_state state_init,
+  const char ** color_classes
+) {
+  struct FANSI_diag diag;
+  struct FANSI_sgr * sgr_in = FANSI_carry_par(par, state_init, &diag);
+  FANSI_diag_raise(&diag, 1, state_init.warn);
+
+  size_t * bytes = (size_t *) R_alloc(par.len, sizeof(size_t));
+  size_t * offs = (size_t *) R_alloc(par.len + 1, sizeof(size_t));
+  int * written = (int *) R_alloc(par.len, sizeof(int));
+  int * errs = (int *) R_alloc(par.len, sizeof(int));
+  struct FANSI_diag * diags =
+    (struct FANSI_diag *) R_alloc(par.threads, sizeof(struct FANSI_diag));
+  memset(diags, 0, par.threads * sizeof(struct FANSI_diag));
+  struct FANSI_state state_read = state_init;
+  state_read.warn = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+  for(int k = 0; k < par.threads; ++k) {
+    for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+      bytes[i] = 0;
+      errs[i] = HTML_OK;
+      if(!par.chrs[i]) continue;
+      struct FANSI_state state = FANSI_sgr_to_state(sgr_in[i], state_read);
+      state.string = par.chrs[i];
+      bytes[i] = html_measure(
+        state, state_read, par.lens[i], color_classes, i, diags + k, errs + i
+      ).bytes;
+  } }
+  FANSI_diag_raise(diags, par.threads, 0);
+  for(R_xlen_t i = 0; i < par.len; ++i) html_raise(errs[i], i);
+
+  offs[0] = 0;
+  for(R_xlen_t i = 0; i < par.len; ++i) offs[i + 1] = offs[i] + bytes[i];
+  if(!offs[par.len]) return x;
+
+  char * buff = R_alloc(offs[par.len], sizeof(char));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(par.threads) schedule(static, 1)
+#endif
+  for(int k = 0; k < par.threads; ++k) {
+    for(R_xlen_t i = par.bounds[k]; i < par.bounds[k + 1]; ++i) {
+      if(!bytes[i]) continue;
+      struct FANSI_state state = FANSI_sgr_to_state(sgr_in[i], state_read);
+      state.string = par.chrs[i];
+      written[i] = html_write(
+        state, state_read, par.lens[i], color_classes, buff + offs[i], i,
+        diags + k, errs + i
+      );
+  } }
+  SEXP res = PROTECT(duplicate(x));
+  for(R_xlen_t i = 0; i < par.len; ++i) {
+    FANSI_interrupt(i);
+    if(!bytes[i]) continue;
+    html_raise(errs[i], i);
+    html_check_len(written[i], bytes[i]);
+    // Now create the charsxp with the original encoding.  Since we're only
+    // removing SGR and adding FANSI, it should be okay.
+
+    cetype_t chr_type = getCharCE(STRING_ELT(x, i));
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+    SEXP chrsxp = PROTECT(
+      mkCharLenCE(buff + offs[i], (R_len_t)(bytes[i] - 1), chr_type)
+    );
+    SET_STRING_ELT(res, i, chrsxp);
+    UNPROTECT(1);
   }
-  int bytes_final = bytes_init + bytes_extra + span_extra;
-  return final_string_size(bytes_final, i);
+  UNPROTECT(1);
+  return res;
 }
 
-SEXP FANSI_esc_to_html(SEXP x, SEXP warn, SEXP term_cap, SEXP color_classes) {
-  if(TYPEOF(x) != STRSXP)
-    error("Internal Error: `x` must be a character vector");  // nocov
-  if(TYPEOF(color_classes) != STRSXP)
-    error("Internal Error: `color_classes` must be a character vector");  // nocov
-
+/*
+ * Sequential version, see `FANSI_esc_to_html`
+ */
+struct html_call {
+  SEXP x;
+  struct FANSI_state state_init;
+  const char ** classes;
+  struct FANSI_buff buff;
+};
+static SEXP esc_to_html(void * data) {
+  struct html_call * call = (struct html_call *) data;
+  SEXP x = call->x;
+  const char ** classes = call->classes;
+  struct FANSI_buff * buff = &call->buff;
   R_xlen_t x_len = XLENGTH(x);
-  struct FANSI_buff buff = {.len=0};
   struct FANSI_state state, state_prev, state_init;
-  state = state_prev = state_init = FANSI_state_init("", warn, term_cap);
-  const char * span_end = "</span>";
-  int span_end_len = (int) strlen(span_end);
+  state = state_prev = state_init = call->state_init;
 
   SEXP res = x;
   // Reserve spot on protection stack
@@ -496,150 +830,58 @@ SEXP FANSI_esc_to_html(SEXP x, SEXP warn, SEXP term_cap, SEXP color_classes) {
     // prior line so that the state can be continued on new line.
     state = FANSI_reset_pos(state_prev);
     state.string = string;
-    struct FANSI_state state_start = FANSI_reset_pos(state);
-    state_prev = state_init;  // but there are no styles in the string yet
-
     int bytes_init = (int) LENGTH(chrsxp);
-    int bytes_html = 0;
-    int bytes_esc = 0;
-
-    size_t bytes_final = 0;
-
-    // Some ESCs may not produce any HTML, and some strings may gain HTML from
-    // an ESC from a prior element even if they have no ESCs.
-    int has_esc = 0;
-    int has_state = state_has_style_html(state);
-    int trail_span = 0;
 
     // Process the strings in two passes, in pass 1 we compute how many bytes
     // we'll need to store the string, and in the second we actually write it.
     // We trade efficiency for convenience.
 
-    // We cheat by only using FANSI_read_next to read escape sequences as we
-    // don't care about display width, etc.  Normally we would _read_next over
-    // all characters, not just skip from ESC to ESC.
+    struct html_meas meas =
+      html_measure(state, state_init, bytes_init, classes, i, NULL, NULL);
 
-    // - Pass 1: Measure -------------------------------------------------------
-
-    // Leftover from prior element (only if can't be merged with new)
-    if(*string && *string != 0x1b && state_has_style_html(state)) {
-      bytes_html += state_size_and_write_as_html(
-        state, state_prev,  NULL, color_classes, i, bytes_html
-      );
-      state_prev = state;
-    }
-    // New in this element
-    while(1) {
-      trail_span = state_has_style_html(state_prev);
-      string = strchr(string, 0x1b);
-      if(!string) string = state.string + bytes_init;
-      else {
-        has_esc = 1;
-        state.pos_byte = (string - state.string);
-      }
-      // State as html, skip if at end of string
-      if(*string) {
-        int esc_start = state.pos_byte;
-        state = FANSI_read_next(state);
-        string = state.string + state.pos_byte;
-        bytes_esc += state.pos_byte - esc_start;  // cannot overflow int
-        if(*string) {
-          bytes_html += state_size_and_write_as_html(
-            state, state_prev,  NULL, color_classes, i, bytes_html
-          );
-        }
-        state_prev = state;
-        has_state |= state_has_style_html(state);
-        if(!*string) break; // nothing after state, so done
-      } else break;
-    }
-    // - Pass 2: Write ---------------------------------------------------------
-
-    if(has_esc || has_state) {
-      bytes_final = html_check_overflow(
-        bytes_html, bytes_esc, bytes_init,
-        span_end_len * trail_span, // Last non-terminal state has style?
-        i
-      );
-      trail_span = 0;
+    if(meas.bytes) {
       // Allocate target vector if it hasn't been yet
       if(res == x) REPROTECT(res = duplicate(x), ipx);
 
-      // Allocate buffer and do second pass, bytes_final includes space for NULL
-      FANSI_size_buff(&buff, bytes_final);
-      string = state.string;  // always points to first byte
-      state_start.warn = state.warn;
-      state = state_start;
-      state_prev = state_init;
-
-      char * buff_track = buff.buff;
-
-      // Very similar to pass 1 loop, but different enough it would be annoying
-      // to make a common function
-
-      if(*string && *string != 0x1b && state_has_style_html(state)) {
-        buff_track += state_size_and_write_as_html(
-          state, state_prev,  buff_track, color_classes, i, 0
-        );
-        state_prev = state;
-      }
-      while(1) {
-        const char * string_prev = string;
-        trail_span = state_has_style_html(state_prev);
-        string = strchr(string, 0x1b);
-        if(!string) string = state.string + bytes_init;
-        else state.pos_byte = (string - state.string);
-
-        // The text since the last ESC
-        int bytes_prev = string - string_prev;
-        memcpy(buff_track, string_prev, bytes_prev);
-        buff_track += bytes_prev;
-        state.pos_byte = (string - state.string);
-
-        // State as html, skip if at end of string
-        if(*string) {
-          state = FANSI_read_next(state);
-          string = state.string + state.pos_byte;
-          if(*string) {
-            buff_track += state_size_and_write_as_html(
-              state, state_prev,  buff_track, color_classes, i, 0
-            );
-          }
-          state_prev = state;
-          if(!*string) break; // nothing after state, so done
-        } else break;
-      }
-      // Trailing SPAN if needed
-      if(trail_span) {
-        memcpy(buff_track,span_end, span_end_len);
-        buff_track += span_end_len;
-      }
-      *(buff_track) = '0';  // not strictly needed
-
-      // Final check that we're not out of sync (recall buff.len includes NULL)
-      if(buff_track - buff.buff != (int)(bytes_final - 1))
-        // nocov start
-        error(
-          "Internal Error: %s (%td vs %zu).",
-          "buffer length mismatch in html generation (2)",
-          buff_track - buff.buff, bytes_final - 1
-        );
-        // nocov end
-
+      // Allocate buffer and do second pass, bytes includes space for NULL
+      FANSI_size_buff(buff, meas.bytes);
+      state.warn = meas.state.warn;
+      int bytes_out = html_write(
+        state, state_init, bytes_init, classes, buff->buff, i, NULL, NULL
+      );
+      html_check_len(bytes_out, meas.bytes);
       // Now create the charsxp with the original encoding.  Since we're only
       // removing SGR and adding FANSI, it should be okay.
 
       cetype_t chr_type = getCharCE(chrsxp);
-      SEXP chrsxp = PROTECT(
-        mkCharLenCE(buff.buff, (R_len_t)(buff_track - buff.buff), chr_type)
-      );
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+      SEXP chrsxp = PROTECT(mkCharLenCE(buff->buff, bytes_out, chr_type));
       SET_STRING_ELT(res, i, chrsxp);
       UNPROTECT(1);
     }
+    state_prev = meas.state;
   }
   UNPROTECT(1);
   return res;
 }
+SEXP FANSI_esc_to_html(SEXP x, SEXP warn, SEXP term_cap, SEXP color_classes) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be a character vector");  // nocov
+  if(TYPEOF(color_classes) != STRSXP)
+    error("Internal Error: `color_classes` must be a character vector");  // nocov
+
+  struct FANSI_state state_init = FANSI_state_init("", warn, term_cap);
+  const char ** classes = get_color_classes(color_classes);
+
+  struct FANSI_par par = FANSI_par_init(x, FANSI_threads());
+  if(par.threads > 1)
+    return html_par(x, par, state_init, classes);
+
+  struct html_call call = {
+    .x=x, .state_init=state_init, .classes=classes, .buff={.len=0}
+  };
+  return FANSI_with_buff(esc_to_html, &call, &call.buff);
+}
 /*
  * Testing interface
  *
@@ -676,10 +918,14 @@ SEXP FANSI_color_to_html_ext(SEXP x) {
  * Escape special HTML characters.
  */
 
-SEXP FANSI_esc_html(SEXP x) {
-  if(TYPEOF(x) != STRSXP)
-    error("Internal Error: `x` must be a character vector");  // nocov
-
+struct esc_html_call {
+  SEXP x;
+  struct FANSI_buff buff;
+};
+static SEXP esc_html(void * data) {
+  struct esc_html_call * call = (struct esc_html_call *) data;
+  SEXP x = call->x;
+  struct FANSI_buff * buff = &call->buff;
   R_xlen_t x_len = XLENGTH(x);
   SEXP res = x;
   // Reserve spot on protection stack
@@ -694,7 +940,6 @@ SEXP FANSI_esc_html(SEXP x) {
     FANSI_check_chrsxp(chrsxp, i);
     int bytes = (int) LENGTH(chrsxp);
     const char * string = CHAR(chrsxp);
-    struct FANSI_buff buff = {.len=0};
 
     // - Pass 1: Measure -------------------------------------------------------
 
@@ -731,9 +976,9 @@ SEXP FANSI_esc_html(SEXP x) {
 
       // Allocate buffer and do second pass, bytes_final includes space for NULL
 
-      FANSI_size_buff(&buff, final_string_size(bytes, i));
+      FANSI_size_buff(buff, final_string_size(bytes, i, NULL));
 
-      char * buff_track = buff.buff;
+      char * buff_track = buff->buff;
       string = CHAR(chrsxp);
 
       while(*string) {
@@ -768,17 +1013,19 @@ SEXP FANSI_esc_html(SEXP x) {
         ++string;
       }
       *buff_track = 0;
-      if(buff_track - buff.buff != bytes)
+      if(buff_track - buff->buff != bytes)
         // nocov start
         error(
           "Internal Error: %s (%td vs %zu).",
           "buffer length mismatch in html escaping",
-          buff_track - buff.buff, bytes
+          buff_track - buff->buff, bytes
         );
         // nocov end
 
       cetype_t chr_type = getCharCE(chrsxp);
-      SEXP reschr = PROTECT(mkCharLenCE(buff.buff, (R_len_t)(bytes), chr_type));
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+      SEXP reschr =
+        PROTECT(mkCharLenCE(buff->buff, (R_len_t)(bytes), chr_type));
       SET_STRING_ELT(res, i, reschr);
       UNPROTECT(1);
     }
@@ -786,4 +1033,11 @@ SEXP FANSI_esc_html(SEXP x) {
   UNPROTECT(1);
   return res;
 }
+SEXP FANSI_esc_html(SEXP x) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be a character vector");  // nocov
+
+  struct esc_html_call call = {.x=x, .buff={.len=0}};
+  return FANSI_with_buff(esc_html, &call, &call.buff);
+}
 
@@ -18,6 +18,50 @@
 
 #include "fansi.h"
 
+/*
+ * Unhandled sequences, one column per field, grown as needed.
+ *
+ * Element index, start, end, error code, then the start and end bytes so we
+ * can substring the problematic sequence at the end.
+ */
+#define UNH_IDX 0
+#define UNH_START 1
+#define UNH_STOP 2
+#define UNH_ERR 3
+#define UNH_BYTE_START 4
+#define UNH_BYTE_STOP 5
+#define UNH_N 6
+
+struct unhandled_cols {
+  int * cols[UNH_N];
+  int len;
+  int alloc;
+};
+
+static void cols_grow(struct unhandled_cols * cols) {
+  int alloc = 64;
+  if(cols->alloc)
+    alloc = cols->alloc > FANSI_int_max / 2 ? FANSI_int_max : cols->alloc * 2;
+  for(int j = 0; j < UNH_N; ++j) {
+    int * tmp = (int *) R_alloc((size_t) alloc, sizeof(int));
+    if(cols->len) memcpy(tmp, cols->cols[j], cols->len * sizeof(int));
+    cols->cols[j] = tmp;
+  }
+  cols->alloc = alloc;
+}
+/*
+ * Whether a string could contain anything `FANSI_read_next` would flag.
+ *
+ * Only Control Sequences, C0 controls other than newline, and UTF-8 (which
+ * could be malformed) can be, so we skip the full read for everything else,
+ * which is the vast majority of strings in most inputs.
+ */
+static int maybe_unhandled(const char * string) {
+  struct FANSI_csi_pos pos =
+    FANSI_find_esc(string, FANSI_CTL_ALL & ~FANSI_CTL_NL);
+  return pos.len || FANSI_has_utf8(string);
+}
+
 SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   if(TYPEOF(x) != STRSXP)
     error("Argument `x` must be a character vector.");  // nocov
@@ -36,89 +80,69 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   SEXP R_one = PROTECT(ScalarInteger(1));
   SEXP no_warn = PROTECT(ScalarLogical(0));
   SEXP ctl_all = PROTECT(ScalarInteger(0));
-  SEXP res, res_start;
-  res = res_start = R_NilValue;
-
-  // reserve spot if we need to alloc later
-
-  PROTECT_INDEX ipx;
-  PROTECT_WITH_INDEX(res, &ipx);
+  struct FANSI_state state_base = FANSI_state_init_full(
+    "", no_warn, term_cap, R_true, R_true, R_one, ctl_all
+  );
+  UNPROTECT(4);
 
-  int any_errors = 0;
-  int err_count = 0;
+  struct unhandled_cols cols = {.len = 0};
   int break_early = 0;
 
   for(R_xlen_t i = 0; i < x_len; ++i) {
     FANSI_interrupt(i);
     SEXP chrsxp = STRING_ELT(x, i);
 
-    if(chrsxp != NA_STRING && LENGTH(chrsxp)) {
-      FANSI_check_chrsxp(chrsxp, i);
-      const char * string, * string_start;
-
-      string = string_start = CHAR(chrsxp);
-
-      struct FANSI_state state = FANSI_state_init_full(
-        string, no_warn, term_cap, R_true, R_true, R_one, ctl_all
-      );
-      int has_errors = 0;
-
-      while(state.string[state.pos_byte]) {
-        // Since we don't care about width, etc, we only use the state objects
-        // to parse the ESC sequences
-
-        int esc_start = state.pos_ansi;
-        int esc_start_byte = state.pos_byte;
-        state = FANSI_read_next(state);
-        if(state.err_code) {
-          if(err_count == FANSI_int_max) {
-            warning(
-              "%s%s",
-              "There are more than INT_MAX unhandled sequences, returning ",
-              "first INT_MAX errors."
-            );
-            break_early = 1;
-            break;
-          }
-          if(esc_start == INT_MAX || state.pos_ansi == INT_MAX)
-            // nocov start
-            error(
-              "%s%s",
-              "Internal error: computed offset is INT_MAX, shouldn't happen; ",
-              "contact maintainer."
-            );
-            // nocov end
-          if(!has_errors) has_errors = 1;
-
-          SEXP err_vals = PROTECT(allocVector(INTSXP, 7));
-          INTEGER(err_vals)[0] = i + 1;
-          INTEGER(err_vals)[1] = esc_start + 1;
-          INTEGER(err_vals)[2] = state.pos_ansi;
-          INTEGER(err_vals)[3] = state.err_code;
-          INTEGER(err_vals)[4] = 0;
-          // need actual bytes so we can substring the problematic sequence, so
-          // we don't use 1 based indexing like with the earlier values
-          INTEGER(err_vals)[5] = esc_start_byte;
-          INTEGER(err_vals)[6] = state.pos_byte - 1;
-          SEXP err_vals_list = PROTECT(list1(err_vals));
-
-          if(!any_errors) {
-            any_errors = 1;
-            REPROTECT(err_vals_list, ipx);
-            res = res_start = err_vals_list;
-          } else {
-            SETCDR(res, err_vals_list);
-            res = CDR(res);
-          }
-          ++err_count;
-          UNPROTECT(2);
+    if(chrsxp == NA_STRING || !LENGTH(chrsxp)) continue;
+    FANSI_check_chrsxp(chrsxp, i);
+    const char * string = CHAR(chrsxp);
+    if(!maybe_unhandled(string)) continue;
+
+    struct FANSI_state state = state_base;
+    state.string = string;
+
+    while(state.string[state.pos_byte]) {
+      // Since we don't care about width, etc, we only use the state objects
+      // to parse the ESC sequences
+
+      int esc_start = state.pos_ansi;
+      int esc_start_byte = state.pos_byte;
+      state = FANSI_read_next(state);
+      if(state.err_code) {
+        if(cols.len == FANSI_int_max) {
+          warning(
+            "%s%s",
+            "There are more than INT_MAX unhandled sequences, returning ",
+            "first INT_MAX errors."
+          );
+          break_early = 1;
+          break;
         }
+        if(esc_start == INT_MAX || state.pos_ansi == INT_MAX)
+          // nocov start
+          error(
+            "%s%s",
+            "Internal error: computed offset is INT_MAX, shouldn't happen; ",
+            "contact maintainer."
+          );
+          // nocov end
+
+        if(cols.len == cols.alloc) cols_grow(&cols);
+        int k = cols.len++;
+        cols.cols[UNH_IDX][k] = i + 1;
+        cols.cols[UNH_START][k] = esc_start + 1;
+        cols.cols[UNH_STOP][k] = state.pos_ansi;
+        cols.cols[UNH_ERR][k] = state.err_code;
+        // need actual bytes so we can substring the problematic sequence, so
+        // we don't use 1 based indexing like with the earlier values
+        cols.cols[UNH_BYTE_START][k] = esc_start_byte;
+        cols.cols[UNH_BYTE_STOP][k] = state.pos_byte - 1;
       }
-      if(break_early) break;
     }
+    if(break_early) break;
   }
   // Convert result to a list that we could easily turn into a DFs
 
+  int err_count = cols.len;
   SEXP res_fin = PROTECT(allocVector(VECSXP, 6));
   SEXP res_idx = PROTECT(allocVector(INTSXP, err_count));
   SEXP res_esc_start = PROTECT(allocVector(INTSXP, err_count));
@@ -127,28 +151,20 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   SEXP res_translated = PROTECT(allocVector(LGLSXP, err_count));
   SEXP res_string = PROTECT(allocVector(STRSXP, err_count));
 
-  res = res_start;
-
+  if(err_count) {
+    size_t bytes = (size_t) err_count * sizeof(int);
+    memcpy(INTEGER(res_idx), cols.cols[UNH_IDX], bytes);
+    memcpy(INTEGER(res_esc_start), cols.cols[UNH_START], bytes);
+    memcpy(INTEGER(res_esc_end), cols.cols[UNH_STOP], bytes);
+    memcpy(INTEGER(res_err_code), cols.cols[UNH_ERR], bytes);
+    memset(LOGICAL(res_translated), 0, bytes);
+  }
   for(int i = 0; i < err_count; ++i) {
     FANSI_interrupt(i);
-    if(res == R_NilValue)
-      // nocov start
-      error(
-        "%s%s",
-        "Internal Error: mismatch between list and err count; "
-        "contact maintainer."
-      );
-      // nocov end
-    INTEGER(res_idx)[i] = INTEGER(CAR(res))[0];
-    INTEGER(res_esc_start)[i] = INTEGER(CAR(res))[1];
-    INTEGER(res_esc_end)[i] = INTEGER(CAR(res))[2];
-    INTEGER(res_err_code)[i] = INTEGER(CAR(res))[3];
-    LOGICAL(res_translated)[i] = INTEGER(CAR(res))[4];
-
-    int byte_start = INTEGER(CAR(res))[5];
-    int byte_end = INTEGER(CAR(res))[6];
+    int byte_start = cols.cols[UNH_BYTE_START][i];
+    int byte_end = cols.cols[UNH_BYTE_STOP][i];
 
-    SEXP cur_chrsxp = STRING_ELT(x, INTEGER(res_idx)[i] - 1);
+    SEXP cur_chrsxp = STRING_ELT(x, cols.cols[UNH_IDX][i] - 1);
 
     if(
       byte_start < 0 || byte_end < 0 || byte_start >= LENGTH(cur_chrsxp) ||
@@ -162,12 +178,12 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
       );
       // nocov end
 
+    FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
     SET_STRING_ELT(res_string, i,
       mkCharLenCE(
         CHAR(cur_chrsxp) + byte_start, byte_end - byte_start + 1,
         getCharCE(cur_chrsxp)
     ) );
-    res = CDR(res);
   }
   SET_VECTOR_ELT(res_fin, 0, res_idx);
   SET_VECTOR_ELT(res_fin, 1, res_esc_start);
@@ -175,6 +191,6 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   SET_VECTOR_ELT(res_fin, 3, res_err_code);
   SET_VECTOR_ELT(res_fin, 4, res_translated);
   SET_VECTOR_ELT(res_fin, 5, res_string);
-  UNPROTECT(12);
+  UNPROTECT(7);
   return res_fin;
 }
@@ -192,3 +192,111 @@ int FANSI_utf8clen(char c)
 }
 
 
+/*
+ * Count UTF-8 characters in a byte run, validating as we go
+ *
+ * Validation follows RFC 3629 (no overlongs, no surrogates, nothing past
+ * U+10FFFF), which is stricter than `FANSI_utf8clen`.  The idea is that we
+ * only trust the count when the run is unambiguously valid, and otherwise
+ * defer to `R_nchar` so that R decides what is and isn't valid.
+ *
+ * @param x the start of the run, need not be NULL terminated.
+ * @param len how many bytes in the run.
+ * @return the number of characters, or -1 if the run is not valid UTF-8.
+ */
+
+int FANSI_utf8_count(const char * x, int len) {
+  const unsigned char * s = (const unsigned char *) x;
+  const unsigned char * end = s + len;
+  int count = 0;
+
+  while(s < end) {
+    unsigned char c = *s;
+    int extra;
+    unsigned char lo = 0x80, hi = 0xBF;  // allowed range of 2nd byte
+
+    if(c < 0x80) {
+      ++s;
+      ++count;
+      continue;
+    }
+    else if(c >= 0xC2 && c <= 0xDF) extra = 1;
+    else if(c >= 0xE0 && c <= 0xEF) {
+      extra = 2;
+      if(c == 0xE0) lo = 0xA0;        // overlong
+      else if(c == 0xED) hi = 0x9F;   // surrogates
+    }
+    else if(c >= 0xF0 && c <= 0xF4) {
+      extra = 3;
+      if(c == 0xF0) lo = 0x90;        // overlong
+      else if(c == 0xF4) hi = 0x8F;   // > U+10FFFF
+    }
+    else return -1;
+
+    if(end - s <= extra) return -1;
+    if(s[1] < lo || s[1] > hi) return -1;
+    for(int i = 2; i <= extra; ++i)
+      if((s[i] & 0xC0) != 0x80) return -1;
+
+    s += extra + 1;
+    ++count;
+  }
+  return count;
+}
+/*
+ * Display width of a run of printable ASCII and common wide characters
+ *
+ * Only the East Asian Wide / Fullwidth blocks below are handled.  They are
+ * two columns wide for every R version and locale, unlike e.g. emoji, whose
+ * width changed across R versions, or East Asian Ambiguous characters, whose
+ * width depends on the locale.  Anything else, including C0 controls, should
+ * be measured by `R_nchar`.
+ *
+ * No R API use so this is safe to call from worker threads.
+ *
+ * @param x the start of the run, need not be NULL terminated.
+ * @param len how many bytes in the run.
+ * @return the display width, or -1 if the run contains anything that is not
+ *   printable ASCII or a character from the ranges below.
+ */
+
+static const unsigned int wide_ranges[][2] = {
+  {0x3041, 0x3096},   // Hiragana
+  {0x30A1, 0x30FA},   // Katakana
+  {0x3400, 0x4DB5},   // CJK Unified Ideographs Extension A
+  {0x4E00, 0x9FA5},   // CJK Unified Ideographs
+  {0xAC00, 0xD7A3},   // Hangul Syllables
+  {0xFF01, 0xFF60},   // Fullwidth ASCII variants
+  {0xFFE0, 0xFFE6}    // Fullwidth symbol variants
+};
+int FANSI_utf8_width(const char * x, int len) {
+  const unsigned char * s = (const unsigned char *) x;
+  const unsigned char * end = s + len;
+  int width = 0;
+  int n_ranges = (int) (sizeof(wide_ranges) / sizeof(wide_ranges[0]));
+
+  while(s < end) {
+    unsigned char c = *s;
+    if(c >= 0x20 && c <= 0x7E) {
+      ++width;
+      ++s;
+      continue;
+    }
+    // All the ranges are three byte sequences; leave anything else to R
+
+    if(c < 0xE3 || c > 0xEF || end - s < 3) return -1;
+    if((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return -1;
+    unsigned int cp =
+      ((unsigned int)(c & 0x0F) << 12) |
+      ((unsigned int)(s[1] & 0x3F) << 6) |
+      (unsigned int)(s[2] & 0x3F);
+
+    int wide = 0;
+    for(int i = 0; i < n_ranges && !wide; ++i)
+      wide = cp >= wide_ranges[i][0] && cp <= wide_ranges[i][1];
+    if(!wide) return -1;
+    width += 2;
+    s += 3;
+  }
+  return width;
+}
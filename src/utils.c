@@ -46,6 +46,41 @@ SEXP FANSI_get_int_max() {
   return ScalarInteger(FANSI_int_max);
 }
 // nocov end
+/*
+ * Instrumentation counters, see FANSI_PERF_* in fansi.h
+ *
+ * Doubles so they can be returned to R without conversion, and so they don't
+ * overflow in long sessions.
+ */
+#ifdef FANSI_PERF
+double FANSI_perf[FANSI_PERF_N];
+#endif
+/*
+ * @param reset TRUE to zero the counters after reading them.
+ * @return the counters, all NA if fansi was compiled without FANSI_PERF.
+ */
+SEXP FANSI_perf_counters(SEXP reset) {
+  if(TYPEOF(reset) != LGLSXP || XLENGTH(reset) != 1)
+    error("Internal Error: invalid `reset` value."); // nocov
+
+  const char * names[FANSI_PERF_N] = {
+    "read_next", "nchar", "buff_alloc", "mkchar", "bytes"
+  };
+  SEXP res = PROTECT(allocVector(REALSXP, FANSI_PERF_N));
+  SEXP res_names = PROTECT(allocVector(STRSXP, FANSI_PERF_N));
+  for(int i = 0; i < FANSI_PERF_N; ++i) {
+#ifdef FANSI_PERF
+    REAL(res)[i] = FANSI_perf[i];
+    if(asLogical(reset)) FANSI_perf[i] = 0;
+#else
+    REAL(res)[i] = NA_REAL;
+#endif
+    SET_STRING_ELT(res_names, i, mkChar(names[i]));
+  }
+  setAttrib(res, R_NamesSymbol, res_names);
+  UNPROTECT(2);
+  return res;
+}
 /*
  * Add integers while checking for overflow
  *
@@ -188,6 +223,7 @@ struct FANSI_csi_pos FANSI_find_esc(const char * x, int ctl) {
     }
     if(found && !found_this) break;
   }
+  FANSI_PERF_ADD(FANSI_PERF_BYTES, x_track - x);
   if(found) {
     res = (struct FANSI_csi_pos){
       .start=x_found_start, .len=(x_found_end - x_found_start),
@@ -206,6 +242,8 @@ struct FANSI_csi_pos FANSI_find_esc(const char * x, int ctl) {
  * We never intend to re-use what's already in memory so we don't realloc.  If
  * allocation is needed the buffer will be either twice as large as it was
  * before, or size `size` if that is greater than twice the size.
+ *
+ * Buffers attached to the pool (see pool.c) are allocated there instead.
  */
 void FANSI_size_buff(struct FANSI_buff * buff, size_t size) {
   if(size > buff->len) {
@@ -250,8 +288,47 @@ void FANSI_size_buff(struct FANSI_buff * buff, size_t size) {
         // nocov end
       buff->len = tmp_double_size;
     }
-    buff->buff = R_alloc(buff->len, sizeof(char));
+    if(!buff->pool) buff->buff = R_alloc(buff->len, sizeof(char));
+    FANSI_PERF_ADD(FANSI_PERF_BUFF, 1);
+  }
+  if(buff->pool) FANSI_pool_size(buff, size);
+}
+/*
+ * Allocate `size` bytes from an arena
+ *
+ * For the many small transient structures some functions need per element or
+ * per line (e.g. error records, line strings) that are only converted to R
+ * objects once at the end.  Memory is carved out of `R_alloc` blocks that
+ * double in size as needed, so there are only a handful of allocations per
+ * call, and like all `R_alloc` memory it is released when the `.Call` returns
+ * or on error.  Blocks are never moved, so pointers stay valid.
+ *
+ * Initialize arenas with `{.len = 0}`.  A NULL `arena` is the same as
+ * `R_alloc`.
+ */
+void * FANSI_arena_alloc(struct FANSI_arena * arena, size_t size) {
+  if(!arena) return R_alloc(size, sizeof(char));
+
+  // Keep everything aligned for any type we could store
+
+  size_t align = sizeof(double) > sizeof(void *) ?
+    sizeof(double) : sizeof(void *);
+  if(size > SIZE_MAX - align)
+    error("Internal Error: arena request too large.");  // nocov
+  size = (size + align - 1) / align * align;
+
+  if(size > arena->len - arena->used) {
+    size_t len = arena->len ? arena->len : 1024;
+    if(len <= SIZE_MAX / 2) len *= 2;
+    if(len < size) len = size;
+    arena->block = R_alloc(len, sizeof(char));
+    arena->len = len;
+    arena->used = 0;
+    FANSI_PERF_ADD(FANSI_PERF_BUFF, 1);
   }
+  void * res = arena->block + arena->used;
+  arena->used += size;
+  return res;
 }
 /*
  * Compute how many digits are in a number
@@ -48,6 +48,7 @@ static struct FANSI_prefix_dat make_pre(SEXP x) {
   SEXP warn = PROTECT(ScalarInteger(2));
   SEXP ctl = PROTECT(ScalarInteger(1));
   SEXP x_strip = PROTECT(FANSI_strip(x, ctl, warn));
+  FANSI_PERF_ADD(FANSI_PERF_NCHAR, 1);
   int x_width = R_nchar(
     asChar(x_strip), Width, TRUE, FALSE, "when computing display width"
   );
@@ -114,25 +115,40 @@ static struct FANSI_prefix_dat drop_pre_indent(struct FANSI_prefix_dat dat) {
   return dat;
 }
 /*
- * Write a line
+ * Write a line into `buff`
  *
  * @param state_bound the point where the boundary is
  * @param state_start the starting point of the line
+ * @param state_open the SGR state the output is in ahead of the line, i.e.
+ *   blank unless the previous line was not terminated.  Only the difference
+ *   between it and `state_start` is written.
+ * @param terminate whether to close the SGR state active at the end of the
+ *   line.
+ * @param normalize whether to close with the codes that turn off each active
+ *   attribute instead of the reset.
+ * @param enc set to the encoding the line should be marked with.
+ * @return the number of bytes written, excluding the NULL terminator.
  */
 
-SEXP FANSI_writeline(
+static int writeline(
   struct FANSI_state state_bound, struct FANSI_state state_start,
   struct FANSI_buff * buff,
   struct FANSI_prefix_dat pre_dat,
-  int tar_width, const char * pad_chr
+  int tar_width, const char * pad_chr,
+  struct FANSI_state state_open, int terminate, int normalize,
+  cetype_t * enc
 ) {
   // Rprintf("  Writeline start with buff %p\n", *buff);
 
   // Check if we are in a CSI state b/c if we are we neeed extra room for
   // the closing state tag
 
-  int needs_close = FANSI_state_has_style(state_bound);
-  int needs_start = FANSI_state_has_style(state_start);
+  struct FANSI_sgr sgr_blank = {.color=-1, .bg_color=-1};
+  struct FANSI_state state_blank = FANSI_sgr_to_state(sgr_blank, state_bound);
+  int close_size = 0;
+  if(terminate && FANSI_state_has_style(state_bound))
+    close_size = normalize ?
+      FANSI_csi_delta_write(NULL, state_bound, state_blank, 1) : 4;
 
   // state_bound.pos_byte 1 past what we need, so this should include room
   // for NULL terminator
@@ -193,14 +209,9 @@ SEXP FANSI_writeline(
     );
   }
   target_size += pre_dat.bytes;
-  int state_start_size = 0;
-  int start_close = 0;
-
-  if(needs_close) start_close += 4;
-  if(needs_start) {
-    state_start_size = FANSI_state_size(state_start);
-    start_close += state_start_size;  // this can't possibly overflow
-  }
+  int state_start_size =
+    FANSI_csi_delta_write(NULL, state_open, state_start, normalize);
+  int start_close = state_start_size + close_size; // can't possibly overflow
   if(target_size > (size_t)(FANSI_int_max - start_close)) {
     error(
       "%s%s",
@@ -218,9 +229,9 @@ SEXP FANSI_writeline(
 
   // Apply prevous CSI style
 
-  if(needs_start) {
+  if(state_start_size) {
     // Rprintf("  writing start: %d\n", state_start_size);
-    FANSI_csi_write(buff_track, state_start, state_start_size);
+    FANSI_csi_delta_write(buff_track, state_open, state_start, normalize);
     buff_track += state_start_size;
   }
   // Apply indent/exdent prefix/initial
@@ -246,20 +257,21 @@ SEXP FANSI_writeline(
   }
   // And turn off CSI styles if needed
 
-  if(needs_close) {
+  if(close_size) {
     // Rprintf("  close\n");
-    memcpy(buff_track, "\033[0m", 4);
-    buff_track += 4;
+    if(normalize)
+      FANSI_csi_delta_write(buff_track, state_bound, state_blank, 1);
+    else memcpy(buff_track, "\033[0m", 4);
+    buff_track += close_size;
   }
   *buff_track = 0;
   // Rprintf("written %d\n", buff_track - (buff->buff) + 1);
 
-  // Now create the charsxp and append to the list, start by determining
-  // what encoding to use.  If pos_byte is greater than pos_ansi it means
-  // we must have hit a UTF8 encoded character
+  // Determine what encoding to use.  If pos_byte is greater than pos_ansi it
+  // means we must have hit a UTF8 encoded character
 
-  cetype_t chr_type = CE_NATIVE;
-  if((state_bound.has_utf8 || pre_dat.has_utf8)) chr_type = CE_UTF8;
+  *enc = CE_NATIVE;
+  if((state_bound.has_utf8 || pre_dat.has_utf8)) *enc = CE_UTF8;
 
   if(buff_track - buff->buff > FANSI_int_max)
     // nocov start
@@ -269,13 +281,17 @@ SEXP FANSI_writeline(
       "contact maintainer (4)."
     );
     // nocov end
-  SEXP res_sxp = PROTECT(
-    mkCharLenCE(
-      buff->buff, (int) (buff_track - buff->buff), chr_type
-  ) );
-  UNPROTECT(1);
-  return res_sxp;
+  return (int) (buff_track - buff->buff);
 }
+/*
+ * Wrapped lines, kept in an arena until we know how many there are.
+ */
+struct wrap_line {
+  struct wrap_line * next;
+  int len;
+  cetype_t enc;
+  char string[];
+};
 /*
  * All input strings are expected to be in UTF8 compatible format (i.e. either
  * encoded in UTF8, or contain only bytes in 0-127).  That way we know we can
@@ -290,6 +306,11 @@ SEXP FANSI_writeline(
  *   depending whether we're at the very first line of the external input or not
  * @param strict whether to hard wrap at width or not (not is what strwrap does
  *   by default)
+ * @param state_carry if not NULL, the SGR state to start the element with, and
+ *   on return the SGR state at the end of the element.
+ * @param state_open the SGR state the output is in ahead of the element, and
+ *   on return the state it is in after the last line.  See `writeline`
+ *   for this and `terminate` and `normalize`.
  */
 
 static SEXP strwrap(
@@ -300,15 +321,14 @@ static SEXP strwrap(
   struct FANSI_buff * buff,
   const char * pad_chr,
   int strip_spaces,
-  SEXP warn, SEXP term_cap,
-  int first_only, SEXP ctl
+  struct FANSI_opts opts,
+  int first_only,
+  struct FANSI_state * state_carry,
+  struct FANSI_state * state_open, int terminate, int normalize,
+  struct FANSI_arena * arena
 ) {
-  SEXP R_true = PROTECT(ScalarLogical(1));
-  SEXP R_one = PROTECT(ScalarInteger(1));
-  struct FANSI_state state = FANSI_state_init_full(
-    x, warn, term_cap, R_true, R_true, R_one, ctl
-  );
-  UNPROTECT(2);
+  struct FANSI_state state = FANSI_state_init_opts(x, opts, 1, 1, 1);
+  if(state_carry) state = FANSI_state_copy_style(state, *state_carry);
 
   int width_1 = FANSI_ADD_INT(width, -pre_first.width);
   int width_2 = FANSI_ADD_INT(width, -pre_next.width);
@@ -320,12 +340,15 @@ static SEXP strwrap(
   if(wrap_always && (width_1 < 0 || width_2 < 0))
     error("Internal Error: incompatible width/indent/prefix."); // nocov
 
-  // Use LISTSXP so we don't have to do a two pass process to determine how many
-  // items we're going to have, unless we're in first only in which case we know
-  // we only need one element per and don't actually use these
+  // Accumulate lines in the arena so we don't have to do a two pass process to
+  // determine how many items we're going to have, unless we're in first only
+  // in which case we know we only need one element per and don't use these.
+  // Lines are discarded once converted, so we can rewind the arena to here at
+  // the end (or to the start of its new block if it had to add one).
 
-  SEXP char_list_start, char_list;
-  char_list_start = char_list = PROTECT(list1(R_NilValue));
+  struct wrap_line * line_start = NULL, * line_last = NULL;
+  char * arena_block = arena->block;
+  size_t arena_used = arena->used;
 
   int prev_boundary = 0;    // tracks if previous char was a boundary
   int has_boundary = 0;     // tracks if at least one boundary in a line
@@ -344,7 +367,7 @@ static SEXP strwrap(
   struct FANSI_state state_start, state_bound, state_prev;
   state_start = state_bound = state_prev = state;
   R_xlen_t size = 0;
-  SEXP res_sxp;
+  SEXP res_sxp = R_NilValue;
 
   while(1) {
     struct FANSI_state state_next;
@@ -428,26 +451,43 @@ static SEXP strwrap(
       }
       // Write the string
 
-      res_sxp = PROTECT(
-        FANSI_writeline(
-          state_bound, state_start, buff,
-          para_start ? pre_first : pre_next,
-          width_tar, pad_chr
-        )
+      cetype_t enc;
+      int len = writeline(
+        state_bound, state_start, buff,
+        para_start ? pre_first : pre_next,
+        width_tar, pad_chr,
+        *state_open, terminate, normalize, &enc
       );
+      if(!terminate) *state_open = state_bound;
+
       first_line = 0;
       last_start = state_start.pos_byte;
       // first_only for `strtrim`
 
       if(!first_only) {
-        SETCDR(char_list, list1(res_sxp));
-        char_list = CDR(char_list);
-        UNPROTECT(1);
-      } else break;
+        struct wrap_line * line = FANSI_arena_alloc(
+          arena, sizeof(struct wrap_line) + (size_t) len
+        );
+        memcpy(line->string, buff->buff, (size_t) len);
+        line->len = len;
+        line->enc = enc;
+        line->next = NULL;
+        if(line_last) line_last->next = line;
+        else line_start = line;
+        line_last = line;
+      } else {
+        FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+        res_sxp = mkCharLenCE(buff->buff, len, enc);
+        break;
+      }
       // overflow should be impossible here since string is at most int long
 
       ++size;
-      if(!state.string[state.pos_byte]) break;
+      if(!state.string[state.pos_byte]) {
+        if(state_carry)
+          *state_carry = FANSI_state_copy_style(*state_carry, state);
+        break;
+      }
 
       // Next line will be the beginning of a paragraph
 
@@ -492,20 +532,21 @@ static SEXP strwrap(
 
   if(!first_only) {
     res = PROTECT(allocVector(STRSXP, size));
-    char_list = char_list_start;
+    struct wrap_line * line = line_start;
     for(R_xlen_t i = 0; i < size; ++i) {
-      char_list = CDR(char_list); // first element is NULL
-      if(char_list == R_NilValue)
+      if(!line)
         error("Internal Error: wrapped element count mismatch");  // nocov
-      SET_STRING_ELT(res, i, CAR(char_list));
+      FANSI_PERF_ADD(FANSI_PERF_MKCHAR, 1);
+      SET_STRING_ELT(res, i, mkCharLenCE(line->string, line->len, line->enc));
+      line = line->next;
     }
-    if(CDR(char_list) != R_NilValue)
+    if(line)
       error("Internal Error: wrapped element count mismatch 2");  // nocov
+    UNPROTECT(1);
   } else {
-    // recall there is an extra open PROTECT in first_only mode
     res = res_sxp;
   }
-  UNPROTECT(2);
+  arena->used = arena->block == arena_block ? arena_used : 0;
   return res;
 }
 
@@ -520,7 +561,7 @@ static SEXP strwrap(
  *   character vector (STRSXP) rather than a VECSXP
  */
 
-SEXP FANSI_strwrap_ext(
+static SEXP strwrap_ext(
   SEXP x, SEXP width,
   SEXP indent, SEXP exdent,
   SEXP prefix, SEXP initial,
@@ -529,7 +570,9 @@ SEXP FANSI_strwrap_ext(
   SEXP tabs_as_spaces, SEXP tab_stops,
   SEXP warn, SEXP term_cap,
   SEXP first_only,
-  SEXP ctl
+  SEXP ctl, SEXP carry,
+  SEXP terminate, SEXP normalize,
+  struct FANSI_buff * buff
 ) {
   if(
     TYPEOF(x) != STRSXP || TYPEOF(width) != INTSXP ||
@@ -542,7 +585,8 @@ SEXP FANSI_strwrap_ext(
     TYPEOF(tabs_as_spaces) != LGLSXP ||
     TYPEOF(tab_stops) != INTSXP ||
     TYPEOF(first_only) != LGLSXP ||
-    TYPEOF(ctl) != INTSXP
+    TYPEOF(ctl) != INTSXP || TYPEOF(carry) != LGLSXP ||
+    TYPEOF(terminate) != LGLSXP || TYPEOF(normalize) != LGLSXP
   )
     error("Internal Error: arg type error 1; contact maintainer.");  // nocov
 
@@ -554,28 +598,23 @@ SEXP FANSI_strwrap_ext(
       "printable ASCII character."
     );
 
-  // Set up the buffer, this will be created in FANSI_strwrap, but we want a
-  // handle for it here so we can re-use
-
-  struct FANSI_buff buff = {.len = 0};
-
   // Strip whitespaces as needed; `strwrap` doesn't seem to do this with prefix
   // and initial, so we don't either
 
   int strip_spaces_int = asInteger(strip_spaces);
 
-  if(strip_spaces_int) x = PROTECT(FANSI_process(x, &buff));
+  if(strip_spaces_int) x = PROTECT(FANSI_process(x, buff));
   else PROTECT(x);
 
   // and tabs
 
   if(asInteger(tabs_as_spaces)) {
-    x = PROTECT(FANSI_tabs_as_spaces(x, tab_stops, &buff, warn, term_cap, ctl));
+    x = PROTECT(FANSI_tabs_as_spaces(x, tab_stops, buff, warn, term_cap, ctl));
     prefix = PROTECT(
-      FANSI_tabs_as_spaces(prefix, tab_stops, &buff, warn, term_cap, ctl)
+      FANSI_tabs_as_spaces(prefix, tab_stops, buff, warn, term_cap, ctl)
     );
     initial = PROTECT(
-      FANSI_tabs_as_spaces(initial, tab_stops, &buff, warn, term_cap, ctl)
+      FANSI_tabs_as_spaces(initial, tab_stops, buff, warn, term_cap, ctl)
     );
   }
   else x = PROTECT(PROTECT(PROTECT(x)));  // PROTECT stack balance
@@ -592,6 +631,14 @@ SEXP FANSI_strwrap_ext(
   int exdent_int = asInteger(exdent);
   int warn_int = asInteger(warn);
   int first_only_int = asInteger(first_only);
+  int carry_int = asInteger(carry);
+  int terminate_int = asInteger(terminate);
+  int normalize_int = asInteger(normalize);
+
+  if(first_only_int && (carry_int || !terminate_int || normalize_int))
+    error(
+      "Internal Error: `carry`, `terminate`, or `normalize` with `first_only`."
+    );  // nocov
 
   if(indent_int < 0 || exdent_int < 0)
     error("Internal Error: illegal indent/exdent values.");  // nocov
@@ -648,7 +695,16 @@ SEXP FANSI_strwrap_ext(
   } else {
     res = PROTECT(allocVector(VECSXP, x_len));
   }
-  // Wrap each element
+  // Wrap each element; with `carry` the SGR state at the end of each element
+  // becomes the starting state of the next one.  Without `terminate` the
+  // output of each line is left in the SGR state at its end, so we track that
+  // across elements whether carrying or not: without `carry` the first line
+  // of the next element then closes what the previous one left open.
+
+  struct FANSI_arena arena = {.len = 0};
+  struct FANSI_opts opts = FANSI_opts_sxp(warn, term_cap, ctl);
+  struct FANSI_state state_carry = FANSI_state_init("", warn, term_cap);
+  struct FANSI_state state_open = state_carry;
 
   for(i = 0; i < x_len; ++i) {
     FANSI_interrupt(i);
@@ -662,12 +718,13 @@ SEXP FANSI_strwrap_ext(
         chr_utf8, width_int,
         i ? pre_first_dat : ini_first_dat,
         pre_next_dat,
-        wrap_always_int, &buff,
+        wrap_always_int, buff,
         CHAR(asChar(pad_end)),
         strip_spaces_int,
-        warn, term_cap,
+        opts,
         first_only_int,
-        ctl
+        carry_int ? &state_carry : NULL,
+        &state_open, terminate_int, normalize_int, &arena
     ) );
     if(first_only_int) {
       SET_STRING_ELT(res, i, str_i);
@@ -679,3 +736,44 @@ SEXP FANSI_strwrap_ext(
   UNPROTECT(5);
   return res;
 }
+/*
+ * The buffer is shared by all the steps (stripping spaces, tabs, wrapping), and
+ * comes from the pool (see pool.c).
+ */
+struct strwrap_call {
+  SEXP x, width, indent, exdent, prefix, initial, wrap_always, pad_end,
+    strip_spaces, tabs_as_spaces, tab_stops, warn, term_cap, first_only, ctl,
+    carry, terminate, normalize;
+  struct FANSI_buff buff;
+};
+static SEXP strwrap_call(void * data) {
+  struct strwrap_call * c = (struct strwrap_call *) data;
+  return strwrap_ext(
+    c->x, c->width, c->indent, c->exdent, c->prefix, c->initial,
+    c->wrap_always, c->pad_end, c->strip_spaces, c->tabs_as_spaces,
+    c->tab_stops, c->warn, c->term_cap, c->first_only, c->ctl, c->carry,
+    c->terminate, c->normalize, &c->buff
+  );
+}
+SEXP FANSI_strwrap_ext(
+  SEXP x, SEXP width,
+  SEXP indent, SEXP exdent,
+  SEXP prefix, SEXP initial,
+  SEXP wrap_always, SEXP pad_end,
+  SEXP strip_spaces,
+  SEXP tabs_as_spaces, SEXP tab_stops,
+  SEXP warn, SEXP term_cap,
+  SEXP first_only,
+  SEXP ctl, SEXP carry,
+  SEXP terminate, SEXP normalize
+) {
+  struct strwrap_call call = {
+    .x=x, .width=width, .indent=indent, .exdent=exdent, .prefix=prefix,
+    .initial=initial, .wrap_always=wrap_always, .pad_end=pad_end,
+    .strip_spaces=strip_spaces, .tabs_as_spaces=tabs_as_spaces,
+    .tab_stops=tab_stops, .warn=warn, .term_cap=term_cap,
+    .first_only=first_only, .ctl=ctl, .carry=carry, .terminate=terminate,
+    .normalize=normalize, .buff={.len = 0}
+  };
+  return FANSI_with_buff(strwrap_call, &call, &call.buff);
+}